@@ -0,0 +1,41 @@
+#version 150
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+// Reduce a depth buffer to the maximum depth over blocks of pixels, for
+// occlusion culling.  The result is written as fragment depth so that it's
+// stored and read back at full depth buffer precision.
+
+uniform sampler2D depthTex;
+// Width of the square block of pixels covered by each output pixel
+uniform int blockSize = 8;
+
+//------------------------------------------------------------------------------
+#if defined(VERTEX_SHADER)
+
+void main()
+{
+    // Full screen triangle from gl_VertexID
+    vec2 pos = vec2((gl_VertexID == 1) ? 3.0 : -1.0, (gl_VertexID == 2) ? 3.0 : -1.0);
+    gl_Position = vec4(pos, 0.0, 1.0);
+}
+
+
+//------------------------------------------------------------------------------
+#elif defined(FRAGMENT_SHADER)
+
+void main()
+{
+    ivec2 size = textureSize(depthTex, 0);
+    ivec2 begin = ivec2(gl_FragCoord.xy)*blockSize;
+    ivec2 end = min(begin + blockSize, size);
+    float maxDepth = 0.0;
+    for (int y = begin.y; y < end.y; ++y)
+    {
+        for (int x = begin.x; x < end.x; ++x)
+            maxDepth = max(maxDepth, texelFetch(depthTex, ivec2(x,y), 0).r);
+    }
+    gl_FragDepth = maxDepth;
+}
+
+#endif
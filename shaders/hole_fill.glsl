@@ -0,0 +1,114 @@
+#version 150
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+// Screen space hole filling for sparse point rendering.
+//
+// Each pixel looks for the nearest surface among the points drawn in a small
+// neighbourhood.  If that surface is in front of the pixel (or the pixel is
+// empty) and surrounds it on at least three sides, the pixel is a hole in
+// the surface - either empty or showing something behind it - and is filled
+// with a depth-aware weighted average of the surrounding surface samples.
+// Silhouettes aren't grown because they're only covered on one side.
+
+uniform mat4 projectionMatrix;
+
+uniform sampler2D colorTex;
+uniform sampler2D depthTex;
+// Radius of neighbourhood to search for surface samples, in pixels
+uniform int fillRadius = 3;
+// Relative distance within which samples are part of the same surface
+uniform float surfaceTolerance = 0.02;
+
+//------------------------------------------------------------------------------
+#if defined(VERTEX_SHADER)
+
+void main()
+{
+    // Full screen triangle from gl_VertexID
+    vec2 pos = vec2((gl_VertexID == 1) ? 3.0 : -1.0, (gl_VertexID == 2) ? 3.0 : -1.0);
+    gl_Position = vec4(pos, 0.0, 1.0);
+}
+
+
+//------------------------------------------------------------------------------
+#elif defined(FRAGMENT_SHADER)
+
+out vec4 fragColor;
+
+// Distance from camera for window space depth in [0,1]
+float linearDepth(float depth)
+{
+    float ndcZ = 2.0*depth - 1.0;
+    return projectionMatrix[3][2]/(ndcZ + projectionMatrix[2][2]);
+}
+
+int quadrant(ivec2 d)
+{
+    if (d.x > 0 && d.y >= 0)
+        return 1;
+    if (d.x <= 0 && d.y > 0)
+        return 2;
+    if (d.x < 0 && d.y <= 0)
+        return 4;
+    return 8;
+}
+
+void main()
+{
+    ivec2 pix = ivec2(gl_FragCoord.xy);
+    ivec2 size = textureSize(depthTex, 0);
+    vec4 color = texelFetch(colorTex, pix, 0);
+    float depth = texelFetch(depthTex, pix, 0).r;
+    float dist = (depth < 1.0) ? linearDepth(depth) : 1e38;
+
+    // Find nearest surface in the neighbourhood
+    float minDist = 1e38;
+    int r2max = fillRadius*fillRadius;
+    for (int dy = -fillRadius; dy <= fillRadius; ++dy)
+    for (int dx = -fillRadius; dx <= fillRadius; ++dx)
+    {
+        ivec2 p = pix + ivec2(dx,dy);
+        if (dx*dx + dy*dy > r2max || any(lessThan(p, ivec2(0))) || any(greaterThanEqual(p, size)))
+            continue;
+        float d = texelFetch(depthTex, p, 0).r;
+        if (d < 1.0)
+            minDist = min(minDist, linearDepth(d));
+    }
+
+    if (minDist < dist*(1.0 - surfaceTolerance))
+    {
+        // Gather samples from the nearest surface
+        float maxSurfaceDist = minDist*(1.0 + surfaceTolerance);
+        vec4 colorSum = vec4(0.0);
+        float weightSum = 0.0;
+        float surfaceDepth = 1.0;
+        int quadrants = 0;
+        for (int dy = -fillRadius; dy <= fillRadius; ++dy)
+        for (int dx = -fillRadius; dx <= fillRadius; ++dx)
+        {
+            ivec2 p = pix + ivec2(dx,dy);
+            if (dx*dx + dy*dy > r2max || any(lessThan(p, ivec2(0))) || any(greaterThanEqual(p, size)))
+                continue;
+            float d = texelFetch(depthTex, p, 0).r;
+            if (d >= 1.0 || linearDepth(d) > maxSurfaceDist)
+                continue;
+            float w = 1.0/float(1 + dx*dx + dy*dy);
+            colorSum += w*texelFetch(colorTex, p, 0);
+            weightSum += w;
+            surfaceDepth = min(surfaceDepth, d);
+            quadrants |= quadrant(ivec2(dx,dy));
+        }
+        int numQuadrants = (quadrants & 1) + ((quadrants >> 1) & 1) +
+                           ((quadrants >> 2) & 1) + ((quadrants >> 3) & 1);
+        if (numQuadrants >= 3)
+        {
+            color = colorSum/weightSum;
+            depth = surfaceDepth;
+        }
+    }
+    fragColor = color;
+    gl_FragDepth = depth;
+}
+
+#endif
@@ -0,0 +1,38 @@
+#version 150
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+// Merge a cached per-geometry render layer into the current framebuffer,
+// using the layer depth so that overlapping layers occlude correctly.
+
+uniform sampler2D colorTex;
+uniform sampler2D depthTex;
+
+//------------------------------------------------------------------------------
+#if defined(VERTEX_SHADER)
+
+void main()
+{
+    // Full screen triangle from gl_VertexID
+    vec2 pos = vec2((gl_VertexID == 1) ? 3.0 : -1.0, (gl_VertexID == 2) ? 3.0 : -1.0);
+    gl_Position = vec4(pos, 0.0, 1.0);
+}
+
+
+//------------------------------------------------------------------------------
+#elif defined(FRAGMENT_SHADER)
+
+out vec4 fragColor;
+
+void main()
+{
+    ivec2 pix = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(depthTex, pix, 0).r;
+    // Nothing drawn in this layer
+    if (depth >= 1.0)
+        discard;
+    fragColor = texelFetch(colorTex, pix, 0);
+    gl_FragDepth = depth;
+}
+
+#endif
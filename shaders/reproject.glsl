@@ -0,0 +1,57 @@
+#version 150
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+// Reproject the previous frame into the current view, as a starting image
+// for progressive drawing.  One point is drawn per pixel of the previous
+// frame; no vertex attributes are required.
+
+uniform sampler2D prevColor;
+uniform sampler2D prevDepth;
+// Transformation from normalized device coordinates in the previous view to
+// clip coordinates in the current view
+uniform mat4 reprojectionMatrix;
+// Size of reprojected pixels, slightly larger than one to cover the small
+// gaps which open up as the view changes
+uniform float pointSize = 1.5;
+// Push reprojected depths back slightly so that freshly drawn points on the
+// same surface replace them
+uniform float depthBias = 0.0001;
+
+//------------------------------------------------------------------------------
+#if defined(VERTEX_SHADER)
+
+flat out vec4 pointColor;
+
+void main()
+{
+    ivec2 size = textureSize(prevDepth, 0);
+    ivec2 pix = ivec2(gl_VertexID % size.x, gl_VertexID / size.x);
+    float depth = texelFetch(prevDepth, pix, 0).r;
+    pointColor = texelFetch(prevColor, pix, 0);
+    gl_PointSize = pointSize;
+    if (depth >= 1.0)
+    {
+        // Background - nothing to reproject, so put it outside the view
+        gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+        return;
+    }
+    vec4 ndc = vec4(2.0*(vec2(pix) + 0.5)/vec2(size) - 1.0, 2.0*depth - 1.0, 1.0);
+    gl_Position = reprojectionMatrix * ndc;
+    gl_Position.z += depthBias*gl_Position.w;
+}
+
+
+//------------------------------------------------------------------------------
+#elif defined(FRAGMENT_SHADER)
+
+flat in vec4 pointColor;
+
+out vec4 fragColor;
+
+void main()
+{
+    fragColor = pointColor;
+}
+
+#endif
@@ -3,42 +3,150 @@
 
 #include "DrawCostModel.h"
 
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+/// Estimate the fraction of the screen covered by `bbox`, using the screen
+/// space bounding rectangle of its corners.
+static double screenCoverage(const Imath::Box3d& bbox, const TransformState& transState)
+{
+    if (bbox.isEmpty())
+        return 0;
+    const M44d mvp = transState.modelViewMatrix * transState.projMatrix;
+    Imath::Box2d rect;
+    for (int i = 0; i < 8; ++i)
+    {
+        V4d p((i & 1) ? bbox.max.x : bbox.min.x,
+              (i & 2) ? bbox.max.y : bbox.min.y,
+              (i & 4) ? bbox.max.z : bbox.min.z, 1);
+        V4d c = p * mvp;
+        // Part of the box is behind the camera, so it can fill the view
+        if (c.w <= 0)
+            return 1;
+        rect.extendBy(Imath::V2d(c.x/c.w, c.y/c.w));
+    }
+    // Intersect with the viewport, which is [-1,1]x[-1,1] in normalized
+    // device coordinates
+    double w = std::min(rect.max.x, 1.0) - std::max(rect.min.x, -1.0);
+    double h = std::min(rect.max.y, 1.0) - std::max(rect.min.y, -1.0);
+    if (w <= 0 || h <= 0)
+        return 0;
+    return w*h/4;
+}
+
+
+/// Number of vertices drawn for a geometry as a function of quality
+///
+/// Counts are interpolated linearly between those sampled by
+/// Geometry::estimateCost(), and assumed proportional to quality outside the
+/// sampled range.  Once a sample shows the geometry fully drawn, the count
+/// can't increase any further.
+class VertexCountCurve
+{
+    public:
+        VertexCountCurve(const double* qualities, const DrawCount* drawCounts,
+                         int numSamps)
+            : m_qualities(qualities, qualities + numSamps),
+            m_maxCount(DBL_MAX)
+        {
+            double n = 0;
+            for (int j = 0; j < numSamps; ++j)
+            {
+                n = std::max(n, drawCounts[j].numVertices);
+                m_counts.push_back(n);
+                if (!drawCounts[j].moreToDraw && m_maxCount == DBL_MAX)
+                    m_maxCount = n;
+            }
+        }
+
+        /// Number of vertices the geometry has to draw
+        double maxCount() const { return m_maxCount; }
+
+        /// Number of vertices drawn at quality `q`
+        double count(double q) const
+        {
+            double q0 = 0, n0 = 0;
+            for (size_t j = 0; j < m_qualities.size(); ++j)
+            {
+                double q1 = m_qualities[j], n1 = m_counts[j];
+                if (q <= q1)
+                    return std::min(m_maxCount, n0 + (n1 - n0)*(q - q0)/(q1 - q0));
+                q0 = q1;
+                n0 = n1;
+            }
+            return std::min(m_maxCount, n0*q/q0);
+        }
+
+        /// Smallest quality at which `n` vertices are drawn
+        double quality(double n) const
+        {
+            double q0 = 0, n0 = 0;
+            for (size_t j = 0; j < m_qualities.size(); ++j)
+            {
+                double q1 = m_qualities[j], n1 = m_counts[j];
+                if (n <= n1 && n1 > n0)
+                    return q0 + (q1 - q0)*(n - n0)/(n1 - n0);
+                q0 = q1;
+                n0 = n1;
+            }
+            return (n0 > 0) ? q0*n/n0 : q0;
+        }
+
+    private:
+        std::vector<double> m_qualities;
+        std::vector<double> m_counts;
+        double m_maxCount;
+};
+
+
 // Figure out quality we should use to render points with the current camera
 // transformation
 double DrawCostModel::quality(double targetMillisecs,
                               const std::vector<const Geometry*>& geoms,
                               const TransformState& transState,
-                              bool firstIncrementalFrame)
+                              bool firstIncrementalFrame,
+                              const OcclusionMap* occlusion,
+                              std::vector<double>& geomQualities)
 {
     // Sample draw count function at various qualities
     const int numQualitySamps = 4;
     double quality = firstIncrementalFrame ? m_incQuality : m_quality;
     double qualities[numQualitySamps] = {quality/20, quality/4, quality, quality*4};
     DrawCount drawCounts[numQualitySamps];
-    for(size_t i = 0; i < geoms.size(); ++i)
+    std::vector<DrawCount> geomDrawCounts(geoms.size()*numQualitySamps);
+    // Geometries are independent, so their culling and cost estimation can
+    // run in parallel.
+    parallelFor(0, geoms.size(), [&](size_t i)
     {
-        geoms[i]->estimateCost(transState, firstIncrementalFrame,
-                               qualities, drawCounts, numQualitySamps);
+        geoms[i]->estimateCost(transState, firstIncrementalFrame, qualities,
+                               &geomDrawCounts[i*numQualitySamps], numQualitySamps,
+                               occlusion);
+    });
+    for (size_t i = 0; i < geoms.size(); ++i)
+    {
+        for (int j = 0; j < numQualitySamps; ++j)
+            drawCounts[j] += geomDrawCounts[i*numQualitySamps + j];
     }
     // Estimate frame time at each quality
     double frameTimeEst[numQualitySamps] = {0};
     for (int i = 0; i < numQualitySamps; ++i)
-    {
-        V3d v(1, drawCounts[i].numVertices, 0);
-        frameTimeEst[i] = m_modelCoeffs.dot(v);
-    }
+        frameTimeEst[i] = m_modelCoeffs.dot(costFeatures(drawCounts[i]));
 
     // Interpolate desired quality using guess at the frame time
-    bool expectMoreToDraw = false;
+    int sampIdx = 0;
     if (targetMillisecs <= frameTimeEst[0])
     {
-        quality = qualities[0];
-        expectMoreToDraw = drawCounts[0].moreToDraw;
+        // Even the lowest sampled quality is over budget.  The constant term
+        // of the model can exceed the target on its own (eg, for full screen
+        // passes), in which case lowering the quality further doesn't help,
+        // so keep the current quality rather than dividing it again.
+        sampIdx = 2;
     }
     else if (targetMillisecs >= frameTimeEst[numQualitySamps-1])
     {
         quality = qualities[numQualitySamps-1];
-        expectMoreToDraw = drawCounts[numQualitySamps-1].moreToDraw;
+        sampIdx = numQualitySamps-1;
     }
     else
     {
@@ -49,8 +157,13 @@ double DrawCostModel::quality(double targetMillisecs,
         double interp = (targetMillisecs - frameTimeEst[i]) /
                         (frameTimeEst[i+1] - frameTimeEst[i]);
         quality = (1-interp)*qualities[i] + interp*qualities[i+1];
-        expectMoreToDraw = drawCounts[i].moreToDraw;
+        sampIdx = i;
     }
+    // Don't let a run of over budget frames drive the quality toward zero,
+    // from where it takes many frames to recover.
+    const double minQuality = 1e-3;
+    quality = std::max(quality, minQuality);
+    bool expectMoreToDraw = drawCounts[sampIdx].moreToDraw;
     if (expectMoreToDraw && !firstIncrementalFrame)
     {
         // Only update reference quality when increasing the quality would
@@ -59,32 +172,185 @@ double DrawCostModel::quality(double targetMillisecs,
         m_quality = quality;
     }
     m_incQuality = quality;
+
+    // Allocate the total vertex count between geometries.  Maximizing the
+    // visible detail sum_i c_i*log(n_i), where c_i is the screen coverage and
+    // n_i the vertex count of geometry i, subject to a fixed total count
+    // gives n_i proportional to c_i.  Each n_i is limited to within a factor
+    // of maxQualityRatio of its count at the common quality, and to the
+    // number of vertices the geometry has.  The proportionality constant is
+    // then chosen so the total, and hence the frame time estimate, is
+    // unchanged where possible.
+    const double maxQualityRatio = 16;
+    geomQualities.assign(geoms.size(), quality);
+    std::vector<VertexCountCurve> curves;
+    std::vector<size_t> geomInds;
+    std::vector<double> coverage;
+    std::vector<double> minCount;
+    std::vector<double> maxCount;
+    double totVertices = 0;
+    double maxScale = 0;
+    for (size_t i = 0; i < geoms.size(); ++i)
+    {
+        VertexCountCurve curve(qualities, &geomDrawCounts[i*numQualitySamps], numQualitySamps);
+        double numVertices = curve.count(quality);
+        if (numVertices <= 0)
+            continue;
+        double c = screenCoverage(geoms[i]->boundingBox(), transState);
+        curves.push_back(curve);
+        geomInds.push_back(i);
+        coverage.push_back(c);
+        minCount.push_back(numVertices/maxQualityRatio);
+        maxCount.push_back(std::min(numVertices*maxQualityRatio, curve.maxCount()));
+        totVertices += numVertices;
+        if (c > 0)
+            maxScale = std::max(maxScale, maxCount.back()/c);
+    }
+    if (maxScale <= 0)
+        return quality;
+    auto allocate = [&](double scale, size_t k)
+    {
+        return std::max(minCount[k], std::min(maxCount[k], scale*coverage[k]));
+    };
+    auto totalCount = [&](double scale)
+    {
+        double total = 0;
+        for (size_t k = 0; k < geomInds.size(); ++k)
+            total += allocate(scale, k);
+        return total;
+    };
+    // The total increases with scale, from at most totVertices at zero.  If
+    // it can't reach totVertices, the geometries are all drawn as fully as
+    // they can be.
+    double scale = maxScale;
+    if (totalCount(maxScale) > totVertices)
+    {
+        double scaleLow = 0;
+        for (int iter = 0; iter < 50; ++iter)
+        {
+            double mid = 0.5*(scaleLow + scale);
+            if (totalCount(mid) > totVertices)
+                scale = mid;
+            else
+                scaleLow = mid;
+        }
+    }
+    for (size_t k = 0; k < geomInds.size(); ++k)
+        geomQualities[geomInds[k]] = curves[k].quality(allocate(scale, k));
     return quality;
 }
 
 
-V3d DrawCostModel::fitCostModel(const DrawRecords& drawRecords)
+/// Return the feature vector for the linear cost model.
+///
+/// Features are scaled so that the coefficients have similar magnitudes,
+/// which keeps the fit well conditioned and the regularization even-handed.
+V4d DrawCostModel::costFeatures(const DrawCount& drawCount)
+{
+    return V4d(1, drawCount.numVertices/1e6, drawCount.numBytes/1e7,
+               drawCount.numDrawCalls/1e3);
+}
+
+
+/// Solve the 4x4 linear system A*x = b by Gaussian elimination with partial
+/// pivoting.  A is assumed to be nonsingular.
+static V4d solve4(double A[4][4], double b[4])
 {
-    // Initialize sums to nonzero for a weak conservative regularization:
-    // assert that we can draw nvsum vertices in tsum millisecs.
-    double nvsum = 1000000;
-    double tsum = 50;
+    for (int k = 0; k < 4; ++k)
+    {
+        int pivot = k;
+        for (int i = k+1; i < 4; ++i)
+        {
+            if (fabs(A[i][k]) > fabs(A[pivot][k]))
+                pivot = i;
+        }
+        std::swap(A[k], A[pivot]);
+        std::swap(b[k], b[pivot]);
+        for (int i = k+1; i < 4; ++i)
+        {
+            double f = A[i][k]/A[k][k];
+            for (int j = k; j < 4; ++j)
+                A[i][j] -= f*A[k][j];
+            b[i] -= f*b[k];
+        }
+    }
+    V4d x;
+    for (int k = 3; k >= 0; --k)
+    {
+        double sum = b[k];
+        for (int j = k+1; j < 4; ++j)
+            sum -= A[k][j]*x[j];
+        x[k] = sum/A[k][k];
+    }
+    return x;
+}
 
-    double regWeight = 1e-3;
-    nvsum *= regWeight;
-    tsum *= regWeight;
 
+V4d DrawCostModel::fitCostModel(const DrawRecords& drawRecords)
+{
+    // Weak conservative prior for the coefficients: assume we can draw a
+    // million vertices in 50 ms, with no other costs.  This dominates only
+    // until there are enough draw records to constrain the fit.
+    const V4d priorCoeffs(0, 50, 0, 0);
+    const double regWeight = 1e-3;
+
+    // Accumulate normal equations for the regularized weighted least squares
+    // problem
+    //
+    //   min_a  sum_i w_i*(x_i.a - t_i)^2 + regWeight*|a - priorCoeffs|^2
+    double A[4][4] = {{0}};
+    double b[4] = {0};
+    for (int j = 0; j < 4; ++j)
+    {
+        A[j][j] = regWeight;
+        b[j] = regWeight*priorCoeffs[j];
+    }
     int numDrawRecs = (int)drawRecords.size();
     for (int i = 0; i < numDrawRecs; ++i)
     {
         // Weight in favour of recent measurements.
         double w = exp(-0.2*(numDrawRecs - 1 - i));
         auto& rec = drawRecords[i];
-        nvsum += w*rec.first.numVertices;
-        tsum += w*rec.second;
+        V4d x = costFeatures(rec.first);
+        for (int j = 0; j < 4; ++j)
+        {
+            for (int k = 0; k < 4; ++k)
+                A[j][k] += w*x[j]*x[k];
+            b[j] += w*x[j]*rec.second;
+        }
     }
 
-    return V3d(0, tsum/nvsum, 0);
+    // Costs can't be negative, but the unconstrained fit may give negative
+    // coefficients when the features are nearly collinear, as they are for
+    // point clouds with a fixed set of fields.  Fix any such coefficients at
+    // zero and refit the rest, which keeps the frame time estimate
+    // increasing with quality.
+    bool fixedZero[4] = {false, false, false, false};
+    V4d coeffs;
+    for (int iter = 0; iter < 4; ++iter)
+    {
+        double Afit[4][4];
+        double bfit[4];
+        for (int j = 0; j < 4; ++j)
+        {
+            for (int k = 0; k < 4; ++k)
+                Afit[j][k] = (fixedZero[j] || fixedZero[k]) ? double(j == k) : A[j][k];
+            bfit[j] = fixedZero[j] ? 0 : b[j];
+        }
+        coeffs = solve4(Afit, bfit);
+        bool allPositive = true;
+        for (int j = 0; j < 4; ++j)
+        {
+            if (coeffs[j] < 0)
+            {
+                fixedZero[j] = true;
+                allPositive = false;
+            }
+        }
+        if (allPositive)
+            break;
+    }
+    for (int j = 0; j < 4; ++j)
+        coeffs[j] = std::max(0.0, coeffs[j]);
+    return coeffs;
 }
-
-
@@ -20,16 +20,19 @@
 ///
 /// We model the cost of drawing geometry as the function
 ///
-///   t(T,q) = a*Nv(T,q)
+///   t(T,q) = a0 + a1*Nv(T,q) + a2*Nb(T,q) + a3*Nc(T,q)
 ///
 /// where
 ///   * t is the frame time
 ///   * T is the camera transformation
 ///   * q is the quality
 ///   * Nv is the number of vertices shaded
+///   * Nb is the number of bytes of vertex data uploaded
+///   * Nc is the number of draw calls
 ///
-/// and a is an unknown fitting parameter which depends on the shader, speed of
-/// the GPU etc.
+/// and the ai are unknown fitting parameters which depend on the shader, speed
+/// of the GPU, fixed per-frame overhead etc.  These are fitted to recent frame
+/// timings by regularized weighted least squares.
 class DrawCostModel
 {
     public:
@@ -41,9 +44,19 @@ class DrawCostModel
             m_modelCoeffs(fitCostModel(m_drawRecords))
         { }
 
+        /// Compute draw quality for the current camera transformation
+        ///
+        /// Returns an overall quality for which the estimated frame time is
+        /// `targetMillisecs`.  `geomQualities` is filled with the quality
+        /// for each of `geoms`; these split the same total amount of geometry
+        /// between the geometries in proportion to their screen coverage, as
+        /// far as each geometry has enough to draw.
+        /// `occlusion` is passed on to Geometry::estimateCost().
         double quality(double targetMillisecs,
                        const std::vector<const Geometry*>& geoms,
-                       const TransformState& transState, bool firstIncrementalFrame);
+                       const TransformState& transState, bool firstIncrementalFrame,
+                       const OcclusionMap* occlusion,
+                       std::vector<double>& geomQualities);
 
         void addSample(const DrawCount& drawCount, double frameTime)
         {
@@ -56,13 +69,14 @@ class DrawCostModel
     private:
         typedef std::deque<std::pair<DrawCount,double>> DrawRecords;
 
-        static V3d fitCostModel(const DrawRecords& drawRecords);
+        static V4d costFeatures(const DrawCount& drawCount);
+        static V4d fitCostModel(const DrawRecords& drawRecords);
 
         double m_quality;
         double m_incQuality;
         int m_maxDrawRecords;
         DrawRecords m_drawRecords;
-        V3d m_modelCoeffs;
+        V4d m_modelCoeffs;
 };
 
 
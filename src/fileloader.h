@@ -171,7 +171,9 @@ class FileLoader : public QObject
                 g_logger.error("Error loading %s: %s", loadInfo.filePath, e.what());
             }
 
-            geom->disconnect();
+            // Only remove the loader connections: the geometry has already
+            // been handed to the GUI thread, which may have connected to it.
+            geom->disconnect(this);
 
             // Completion
             emit loadStepComplete();
@@ -9,6 +9,7 @@
 #include "geometrycollection.h"
 #include "HelpDialog.h"
 #include "IpcChannel.h"
+#include "PointArray.h"
 #include "QtLogger.h"
 #include "TriMesh.h"
 #include "Enable.h"
@@ -41,6 +42,9 @@
 #include <QMimeData>
 #include <QGLFormat>
 
+#include <algorithm>
+#include <climits>
+
 //------------------------------------------------------------------------------
 // MainWindow implementation
 
@@ -243,6 +247,9 @@ MainWindow::MainWindow(const QGLFormat& format)
     viewMenu->addAction(m_pointView->m_axesAction);
     viewMenu->addAction(m_pointView->m_gridAction);
     viewMenu->addAction(m_pointView->m_annotationAction);
+    viewMenu->addAction(m_pointView->m_fillHolesAction);
+    viewMenu->addAction(m_pointView->m_cacheLayersAction);
+    viewMenu->addAction(m_pointView->m_occlusionCullingAction);
 
     //--------------------------------------------------
     // Docked widgets
@@ -573,6 +580,16 @@ void MainWindow::handleMessage(QByteArray message)
         std::string response = tfm::format("%.15g %.15g %.15g", p.x, p.y, p.z);
         channel->sendMessage(QByteArray(response.data(), (int)response.size()));
     }
+    else if (commandTokens[0] == "QUERY_POINTS")
+    {
+        IpcChannel* channel = dynamic_cast<IpcChannel*>(sender());
+        if (!channel)
+        {
+            qWarning() << "Signalling object not a IpcChannel!\n";
+            return;
+        }
+        channel->sendMessage(queryPoints(commandTokens));
+    }
     else if (commandTokens[0] == "QUIT")
     {
         close();
@@ -637,6 +654,168 @@ void MainWindow::handleMessage(QByteArray message)
 }
 
 
+/// Find points of a loaded point cloud inside a region, for the QUERY_POINTS
+/// message.  The message lines are
+///
+///   QUERY_POINTS
+///   <dataset label>
+///   <region>
+///   [field names, separated by spaces; all fields if omitted]
+///
+/// where the region is one of
+///
+///   BOX xmin ymin zmin xmax ymax zmax
+///   SPHERE x y z radius
+///   ORIENTED_BOX x y z  ax ay az  bx by bz  cx cy cz  ha hb hc
+///   NEAREST x y z k
+///
+/// For ORIENTED_BOX, (x,y,z) is the box center, a, b and c are orthogonal
+/// axes and ha, hb and hc the half widths along each.
+///
+/// The response is "ERROR\n<message>" on failure.  Otherwise it's a text
+/// header followed by binary data:
+///
+///   POINTS <count>
+///   <name> <type>            (one line per column)
+///   <empty line>
+///   <column data>
+///
+/// The first column is "index uint64_t[1]", giving point indices in the
+/// source file.  The remaining columns are the requested fields in the order
+/// given, or all fields in dataset order if none were requested.  Each field
+/// may be requested only once.  Each column holds `count` values packed in native byte
+/// order, one column after another.  Positions are returned as double[3]
+/// with the dataset offset added.
+QByteArray MainWindow::queryPoints(const QList<QByteArray>& commandTokens)
+{
+    auto errorResponse = [](const std::string& message)
+    {
+        g_logger.error("QUERY_POINTS: %s", message);
+        return QByteArray("ERROR\n") + message.c_str();
+    };
+    if (commandTokens.size() < 3)
+        return errorResponse("Expected dataset label and region");
+    QModelIndex geomIndex = m_geometries->findLabel(
+            QRegExp(commandTokens[1], Qt::CaseSensitive, QRegExp::FixedString));
+    if (!geomIndex.isValid())
+        return errorResponse(tfm::format("No dataset with label \"%s\"", commandTokens[1].constData()));
+    const PointArray* points = dynamic_cast<const PointArray*>(
+            m_geometries->get()[geomIndex.row()].get());
+    if (!points)
+        return errorResponse("Spatial queries are only supported for point clouds");
+
+    QList<QByteArray> regionTokens = commandTokens[2].simplified().split(' ');
+    QByteArray regionType = regionTokens[0];
+    std::vector<double> args;
+    for (int i = 1; i < regionTokens.size(); ++i)
+    {
+        bool ok = false;
+        args.push_back(regionTokens[i].toDouble(&ok));
+        if (!ok)
+            return errorResponse(tfm::format("Could not parse region argument \"%s\"",
+                                             regionTokens[i].constData()));
+    }
+    auto argVec = [&](size_t i) { return V3d(args[i], args[i+1], args[i+2]); };
+    std::vector<size_t> indices;
+    if (regionType == "BOX" && args.size() == 6)
+        points->findInBox(Imath::Box3d(argVec(0), argVec(3)), indices);
+    else if (regionType == "SPHERE" && args.size() == 4)
+        points->findInSphere(argVec(0), args[3], indices);
+    else if (regionType == "ORIENTED_BOX" && args.size() == 15)
+    {
+        V3d axes[3] = {argVec(3), argVec(6), argVec(9)};
+        points->findInOrientedBox(argVec(0), axes, argVec(12), indices);
+    }
+    else if (regionType == "NEAREST" && args.size() == 4 && args[3] >= 0)
+        points->findNearest(argVec(0), (size_t)args[3], indices);
+    else
+        return errorResponse(tfm::format("Invalid region \"%s\"", commandTokens[2].constData()));
+
+    // Select fields
+    const std::vector<GeomField>& fields = points->fields();
+    std::vector<const GeomField*> queryFields;
+    QList<QByteArray> fieldNames;
+    if (commandTokens.size() > 3)
+        fieldNames = commandTokens[3].simplified().split(' ');
+    fieldNames.removeAll(QByteArray());
+    if (fieldNames.isEmpty())
+    {
+        for (const GeomField& field : fields)
+            queryFields.push_back(&field);
+    }
+    for (int i = 0; i < fieldNames.size(); ++i)
+    {
+        const QByteArray& name = fieldNames[i];
+        if (fieldNames.indexOf(name) != i)
+            return errorResponse(tfm::format("Duplicate field \"%s\"", name.constData()));
+        auto field = std::find_if(fields.begin(), fields.end(),
+                                  [&](const GeomField& f) { return name == f.name.c_str(); });
+        if (field == fields.end())
+            return errorResponse(tfm::format("Unknown field \"%s\"", name.constData()));
+        queryFields.push_back(&*field);
+    }
+
+    // Header
+    auto isPosition = [](const GeomField* field)
+    {
+        return field->name == "position" && field->spec == TypeSpec::vec3float32();
+    };
+    size_t n = indices.size();
+    size_t pointSize = sizeof(uint64_t);
+    std::ostringstream header;
+    tfm::format(header, "POINTS %d\nindex uint64_t[1]\n", n);
+    for (const GeomField* field : queryFields)
+    {
+        if (isPosition(field))
+        {
+            tfm::format(header, "position double[3]\n");
+            pointSize += sizeof(V3d);
+        }
+        else
+        {
+            tfm::format(header, "%s %s\n", field->name, field->spec);
+            pointSize += field->spec.size();
+        }
+    }
+    header << "\n";
+    QByteArray response(header.str().c_str());
+    // QByteArray is limited to INT_MAX bytes
+    if (n > (size_t)(INT_MAX - response.size())/pointSize)
+    {
+        return errorResponse(tfm::format("Result of %d points is too large to send; "
+                                         "query a smaller region or fewer fields", n));
+    }
+    response.reserve(response.size() + (int)(n*pointSize));
+
+    // Column data
+    for (size_t i = 0; i < n; ++i)
+    {
+        uint64_t fileIndex = points->fileIndex(indices[i]);
+        response.append((const char*)&fileIndex, sizeof(fileIndex));
+    }
+    for (const GeomField* field : queryFields)
+    {
+        if (isPosition(field))
+        {
+            // Special case for position, since it has an associated offset
+            const V3f* P = (const V3f*)field->as<float>();
+            for (size_t i = 0; i < n; ++i)
+            {
+                V3d p = V3d(P[indices[i]]) + points->offset();
+                response.append((const char*)&p, sizeof(p));
+            }
+        }
+        else
+        {
+            int size = field->spec.size();
+            for (size_t i = 0; i < n; ++i)
+                response.append(field->data.get() + indices[i]*size, size);
+        }
+    }
+    return response;
+}
+
+
 QByteArray MainWindow::hookPayload(QByteArray payload)
 {
     if(payload == QByteArray("cursor"))
@@ -86,6 +86,7 @@ class MainWindow : public QMainWindow
     private:
         void readSettings();
         void writeSettings();
+        QByteArray queryPoints(const QList<QByteArray>& commandTokens);
 
     private:
         // Gui objects
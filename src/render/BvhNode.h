@@ -0,0 +1,82 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#pragma once
+
+#include <cfloat>
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <vector>
+
+#include "util.h"
+
+//------------------------------------------------------------------------------
+/// Node of a binary bounding volume hierarchy
+///
+/// Nodes are stored in depth first order in a flat array, so the first child
+/// of a node directly follows it.  The items of each subtree are a contiguous
+/// range of an index array held by the owner of the hierarchy.
+struct BvhNode
+{
+    Imath::Box3f bbox;    ///< Bounds of items in subtree
+    uint32_t beginIndex;  ///< Items of subtree are at [beginIndex,endIndex) of the index array
+    uint32_t endIndex;
+    uint32_t secondChild; ///< First child is at this node index + 1
+    bool isLeaf;
+};
+
+
+/// Find the item of a hierarchy nearest to the origin of `distFunc`, where
+/// the true node bounds are `bbox + offset`.
+///
+/// Nodes are visited best first, in order of their distance bound, until no
+/// remaining node can hold an item closer than the best found so far.
+/// `searchLeaf(leaf, leafDist)` must return the index of the item of `leaf`
+/// nearest to the origin, and set `leafDist` to its distance.
+///
+/// Only items closer than `maxDist` are considered.  If there are none,
+/// return size_t(-1) and set `dist` to DBL_MAX.
+template<typename SearchLeafFuncT>
+size_t findNearestInBvh(const std::vector<BvhNode>& nodes,
+                        const EllipticalDist& distFunc, const V3d& offset,
+                        double maxDist, double& dist, SearchLeafFuncT searchLeaf)
+{
+    dist = DBL_MAX;
+    size_t nearestIdx = -1;
+    if (nodes.empty())
+        return nearestIdx;
+    auto distBound = [&](uint32_t nodeIndex)
+    {
+        const Imath::Box3f& b = nodes[nodeIndex].bbox;
+        return distFunc.boundNearest(Box3d(offset + V3d(b.min), offset + V3d(b.max)));
+    };
+    typedef std::pair<double, uint32_t> PriorityNode;
+    std::priority_queue<PriorityNode, std::vector<PriorityNode>,
+                        std::greater<PriorityNode>> pendingNodes;
+    double closestDist = maxDist;
+    pendingNodes.push(PriorityNode(distBound(0), 0));
+    while (!pendingNodes.empty())
+    {
+        PriorityNode next = pendingNodes.top();
+        if (next.first >= closestDist)
+            break;
+        pendingNodes.pop();
+        const BvhNode& node = nodes[next.second];
+        if (!node.isLeaf)
+        {
+            pendingNodes.push(PriorityNode(distBound(next.second + 1), next.second + 1));
+            pendingNodes.push(PriorityNode(distBound(node.secondChild), node.secondChild));
+            continue;
+        }
+        double leafDist = DBL_MAX;
+        size_t leafIdx = searchLeaf(node, leafDist);
+        if (leafDist < closestDist)
+        {
+            closestDist = leafDist;
+            dist = leafDist;
+            nearestIdx = leafIdx;
+        }
+    }
+    return nearestIdx;
+}
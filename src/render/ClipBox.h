@@ -3,7 +3,11 @@
 
 #pragma once
 
-#include <algorithm>
+#include <cmath>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "glutil.h"
 
@@ -20,10 +24,23 @@
 ///   -wc <= yc <= wc
 ///   -wc <= zc <= wc
 ///
+/// Boxes are tested against each plane using their center and half extent:
+/// a box lies entirely on the negative side of a plane with normal n when
+/// dot(n,center) + d + dot(abs(n),extent) < 0, which is equivalent to
+/// testing all eight corners.  The plane coefficients are stored in
+/// structure of arrays form so that the tests can be done with SSE2.
 
 class ClipBox
 {
     public:
+        /// Classification of a box with respect to the clipping volume
+        enum Classification
+        {
+            Outside,   ///< Entirely outside; can be culled
+            Intersect, ///< Possibly straddling the boundary
+            Inside     ///< Entirely inside; descendants need no culling
+        };
+
         ClipBox(const TransformState& transState)
         {
             // Extract plane equations for frustum clipping.  The clipping
@@ -36,46 +53,136 @@ class ClipBox
             const V3f c2 = V3f(mvp[0][1], mvp[1][1], mvp[2][1]); const float d2 = mvp[3][1];
             const V3f c3 = V3f(mvp[0][2], mvp[1][2], mvp[2][2]); const float d3 = mvp[3][2];
             const V3f c4 = V3f(mvp[0][3], mvp[1][3], mvp[2][3]); const float d4 = mvp[3][3];
-            normal[0] = c4 + c1;  distance[0] = d4 + d1;
-            normal[1] = c4 - c1;  distance[1] = d4 - d1;
-            normal[2] = c4 + c2;  distance[2] = d4 + d2;
-            normal[3] = c4 - c2;  distance[3] = d4 - d2;
-            normal[4] = c4 + c3;  distance[4] = d4 + d3;
-            normal[5] = c4 - c3;  distance[5] = d4 - d3;
+            setPlane(0, c4 + c1, d4 + d1);
+            setPlane(1, c4 - c1, d4 - d1);
+            setPlane(2, c4 + c2, d4 + d2);
+            setPlane(3, c4 - c2, d4 - d2);
+            setPlane(4, c4 + c3, d4 + d3);
+            setPlane(5, c4 - c3, d4 - d3);
+            // Padding planes which every box is inside of
+            for (int j = 6; j < 8; ++j)
+                setPlane(j, V3f(0), 1);
         }
 
         /// Determine whether `box` lies entirely outside the clipping volume
         /// and can therefore be discarded
         bool canCull(const Imath::Box3f& box) const
         {
-            // Box corners
-            const V3f points[8] = {
-                V3f(box.min.x, box.min.y, box.min.z),
-                V3f(box.min.x, box.max.y, box.min.z),
-                V3f(box.max.x, box.max.y, box.min.z),
-                V3f(box.max.x, box.min.y, box.min.z),
-                V3f(box.min.x, box.min.y, box.max.z),
-                V3f(box.min.x, box.max.y, box.max.z),
-                V3f(box.max.x, box.max.y, box.max.z),
-                V3f(box.max.x, box.min.y, box.max.z),
-            };
+            return classify(box) == Outside;
+        }
 
-            // We can cull if all box vertices are outside any clipping plane.
-            // This underestimates possible culling for some corner cases,
-            // but is far simpler than the alternatives.
+        /// Classify `box` as outside, inside, or intersecting the clipping
+        /// volume.
+        ///
+        /// A box is only reported as outside when it's entirely on the wrong
+        /// side of a single plane.  This underestimates possible culling for
+        /// some corner cases, but is far simpler than the alternatives.
+        Classification classify(const Imath::Box3f& box) const
+        {
+            if (box.isEmpty())
+                return Outside;
+            const V3f c = box.center();
+            const V3f e = 0.5f*box.size();
+            int outside = 0;
+            int intersect = 0;
+#ifdef __SSE2__
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 cx = _mm_set1_ps(c.x), cy = _mm_set1_ps(c.y), cz = _mm_set1_ps(c.z);
+            const __m128 ex = _mm_set1_ps(e.x), ey = _mm_set1_ps(e.y), ez = _mm_set1_ps(e.z);
+            for (int j = 0; j < 8; j += 4)
+            {
+                __m128 s = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(m_nx + j), cx),
+                                                 _mm_mul_ps(_mm_load_ps(m_ny + j), cy)),
+                                      _mm_add_ps(_mm_mul_ps(_mm_load_ps(m_nz + j), cz),
+                                                 _mm_load_ps(m_d + j)));
+                __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(m_absNx + j), ex),
+                                                 _mm_mul_ps(_mm_load_ps(m_absNy + j), ey)),
+                                      _mm_mul_ps(_mm_load_ps(m_absNz + j), ez));
+                outside   |= _mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(s, r), zero));
+                intersect |= _mm_movemask_ps(_mm_cmplt_ps(_mm_sub_ps(s, r), zero));
+            }
+#else
             for (int j = 0; j < 6; ++j)
             {
-                if (std::all_of(std::begin(points), std::end(points), [&](const auto& p)
-                    { return normal[j].dot(p) + distance[j] < 0.0; }))
+                float s = m_nx[j]*c.x + m_ny[j]*c.y + m_nz[j]*c.z + m_d[j];
+                float r = m_absNx[j]*e.x + m_absNy[j]*e.y + m_absNz[j]*e.z;
+                outside   |= (s + r < 0);
+                intersect |= (s - r < 0);
+            }
+#endif
+            return outside ? Outside : (intersect ? Intersect : Inside);
+        }
+
+        /// Classify `count` boxes at once, writing the results into
+        /// `classes`.  This is equivalent to calling classify() for each box,
+        /// but tests four boxes at a time where SSE2 is available.
+        void classify(const Imath::Box3f* boxes, size_t count,
+                      Classification* classes) const
+        {
+            size_t i = 0;
+#ifdef __SSE2__
+            const __m128 zero = _mm_setzero_ps();
+            for (; i + 4 <= count; i += 4)
+            {
+                // Transpose four boxes into center and extent vectors
+                alignas(16) float c[3][4];
+                alignas(16) float e[3][4];
+                for (int b = 0; b < 4; ++b)
                 {
-                    return true;
+                    const Imath::Box3f& box = boxes[i+b];
+                    for (int a = 0; a < 3; ++a)
+                    {
+                        c[a][b] = 0.5f*(box.min[a] + box.max[a]);
+                        e[a][b] = 0.5f*(box.max[a] - box.min[a]);
+                    }
+                }
+                const __m128 cx = _mm_load_ps(c[0]), cy = _mm_load_ps(c[1]), cz = _mm_load_ps(c[2]);
+                const __m128 ex = _mm_load_ps(e[0]), ey = _mm_load_ps(e[1]), ez = _mm_load_ps(e[2]);
+                __m128 outside = zero;
+                __m128 intersect = zero;
+                for (int j = 0; j < 6; ++j)
+                {
+                    __m128 s = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m_nx[j]), cx),
+                                                     _mm_mul_ps(_mm_set1_ps(m_ny[j]), cy)),
+                                          _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m_nz[j]), cz),
+                                                     _mm_set1_ps(m_d[j])));
+                    __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m_absNx[j]), ex),
+                                                     _mm_mul_ps(_mm_set1_ps(m_absNy[j]), ey)),
+                                          _mm_mul_ps(_mm_set1_ps(m_absNz[j]), ez));
+                    outside   = _mm_or_ps(outside,   _mm_cmplt_ps(_mm_add_ps(s, r), zero));
+                    intersect = _mm_or_ps(intersect, _mm_cmplt_ps(_mm_sub_ps(s, r), zero));
+                }
+                int outsideMask = _mm_movemask_ps(outside);
+                int intersectMask = _mm_movemask_ps(intersect);
+                for (int b = 0; b < 4; ++b)
+                {
+                    if (boxes[i+b].isEmpty() || (outsideMask & (1 << b)))
+                        classes[i+b] = Outside;
+                    else
+                        classes[i+b] = (intersectMask & (1 << b)) ? Intersect : Inside;
                 }
             }
-            return false;
+#endif
+            for (; i < count; ++i)
+                classes[i] = classify(boxes[i]);
         }
 
     private:
-        // Plane equation coeffs:  normal[j].dot(v) + distance[j] == 0
-        Imath::V3f normal[6];
-        float distance[6];
+        void setPlane(int j, const V3f& normal, float distance)
+        {
+            m_nx[j] = normal.x;  m_absNx[j] = std::abs(normal.x);
+            m_ny[j] = normal.y;  m_absNy[j] = std::abs(normal.y);
+            m_nz[j] = normal.z;  m_absNz[j] = std::abs(normal.z);
+            m_d[j] = distance;
+        }
+
+        // Plane equation coeffs:  n[j].dot(v) + d[j] == 0, padded to eight
+        // planes for SIMD
+        alignas(16) float m_nx[8];
+        alignas(16) float m_ny[8];
+        alignas(16) float m_nz[8];
+        alignas(16) float m_d[8];
+        alignas(16) float m_absNx[8];
+        alignas(16) float m_absNy[8];
+        alignas(16) float m_absNz[8];
 };
@@ -4,6 +4,7 @@
 #ifndef DISPLAZ_GEOMETRY_H_INCLUDED
 #define DISPLAZ_GEOMETRY_H_INCLUDED
 
+#include <atomic>
 #include <memory>
 #include <vector>
 #include <map>
@@ -17,23 +18,30 @@
 
 class ShaderProgram;
 class QOpenGLShaderProgram;
+class OcclusionMap;
 struct TransformState;
 
 
 /// Estimate of amount of geometry drawn in a frame
 ///
 /// `numVertices` is the number of vertices
+/// `numBytes` is the number of bytes of vertex data uploaded to the GPU
+/// `numDrawCalls` is the number of draw calls issued
 /// `moreToDraw` indicates whether the geometry is completely drawn
 struct DrawCount
 {
     double numVertices;
+    double numBytes;
+    double numDrawCalls;
     bool   moreToDraw;
 
-    DrawCount() : numVertices(0), moreToDraw(false) { }
+    DrawCount() : numVertices(0), numBytes(0), numDrawCalls(0), moreToDraw(false) { }
 
     DrawCount& operator+=(const DrawCount& rhs)
     {
         numVertices += rhs.numVertices;
+        numBytes += rhs.numBytes;
+        numDrawCalls += rhs.numDrawCalls;
         moreToDraw |= rhs.moreToDraw;
         return *this;
     }
@@ -88,14 +96,33 @@ class Geometry : public QObject
         /// transState specifies the camera transform, quality specifies the
         /// desired amount of simplification; incrementalDraw is true if this
         /// should be an incremental frame to build on a previous call to
-        /// drawPoints which returned true.
+        /// drawPoints which returned true.  If `occlusion` is non-null,
+        /// parts of the geometry hidden behind previously drawn geometry may
+        /// be skipped (see OcclusionMap).
         ///
         /// The returned DrawCount should be filled with an estimate of the
         /// actual amount of geometry shaded and whether there's any more to be
         /// drawn.
         virtual DrawCount drawPoints(QOpenGLShaderProgram& pointShaderProg,
                                      const TransformState& transState, double quality,
-                                     bool incrementalDraw) const { return DrawCount(); }
+                                     bool incrementalDraw,
+                                     const OcclusionMap* occlusion) const { return DrawCount(); }
+
+        /// Do the CPU side work for a following call to drawPoints() with
+        /// the same arguments, such as culling and level of detail
+        /// selection.
+        ///
+        /// This may be called from a worker thread while other geometries,
+        /// or earlier parts of this one, are drawn, so it must not make any
+        /// OpenGL calls.
+        virtual void prepareDrawPoints(const TransformState& transState, double quality,
+                                       bool incrementalDraw,
+                                       const OcclusionMap* occlusion) const {}
+
+        /// Announce that prepareDrawPoints() has been queued on a worker
+        /// thread, so that a following drawPoints() can wait for its results
+        /// rather than doing the work again.
+        virtual void schedulePrepareDrawPoints() const {}
 
         /// Draw edges with the given shader
         virtual void drawEdges(QOpenGLShaderProgram& edgeShaderProg,
@@ -110,14 +137,18 @@ class Geometry : public QObject
         /// Estimate the number of vertices which would be shaded when
         /// the draw() functions are called with the given quality settings.
         ///
-        /// transState and incrementalDraw are as in drawPoints.
+        /// transState, incrementalDraw and occlusion are as in drawPoints.
         ///
         /// `drawCounts[i]` should be filled with an estimate of the count of
         /// verts drawn at the given quality `qualities[i]`.  `numEstimates` is
         /// the number of elements in the qualities array.
+        ///
+        /// Different geometries may be estimated concurrently on worker
+        /// threads, so this must not make any OpenGL calls.
         virtual void estimateCost(const TransformState& transState,
                                   bool incrementalDraw, const double* qualities,
-                                  DrawCount* drawCounts, int numEstimates) const = 0;
+                                  DrawCount* drawCounts, int numEstimates,
+                                  const OcclusionMap* occlusion) const = 0;
 
         /// Pick a vertex on the geometry given a ray representing a mouse click
         ///
@@ -130,11 +161,18 @@ class Geometry : public QObject
         /// with the ray direction scaled by the amount normalDirectionScale.
         /// This distance is returned in the distance parameter when it is
         /// non-null.
+        ///
+        /// When several geometries are picked concurrently, `distBound` holds
+        /// the distance to the closest vertex found so far by any of them.
+        /// Vertices further away may be ignored, returning false if there
+        /// are no others, and closer vertices reduce the bound.  This must be
+        /// safe to call from any thread.
         virtual bool pickVertex(const V3d& cameraPos,
                                 const EllipticalDist& distFunc,
                                 V3d& pickedVertex,
                                 double* distance = 0,
-                                std::string* info = 0) const = 0;
+                                std::string* info = 0,
+                                std::atomic<double>* distBound = 0) const = 0;
 
         //--------------------------------------------------
         /// Get the arbitrary user-defined label for the geometry.
@@ -174,6 +212,9 @@ class Geometry : public QObject
         void loadProgress(int percentLoaded);
         /// Emitted at the end of point loading
         void loadStepComplete();
+        /// Emitted, possibly from a background thread, when data streamed
+        /// in after loading becomes available for drawing
+        void dataAvailable();
 
     protected:
         void setFileName(const QString& fileName) { m_fileName = fileName; }
@@ -3,7 +3,9 @@
 
 #include "HCloudView.h"
 
+#include <algorithm>
 #include <cfloat>
+#include <queue>
 
 #include "hcloud.h"
 #include "ClipBox.h"
@@ -22,15 +24,24 @@ struct HCloudNode
 
     NodeIndexData idata;
     bool isLeaf;
+    uint64_t lastUsedFrame;  ///< Last frame in which the node data was used
 
-    // List of non-empty voxels inside the node
-    std::unique_ptr<float[]> position;
-    std::unique_ptr<float[]> intensity;
-    std::unique_ptr<float[]> coverage;
+    // List of non-empty voxels inside the node.  The arrays point into the
+    // page cache when it supports this, or otherwise at the storage below.
+    const float* position;
+    const float* intensity;
+    const float* coverage;
+    std::unique_ptr<float[]> positionStorage;
+    std::unique_ptr<float[]> intensityStorage;
+    std::unique_ptr<float[]> coverageStorage;
 
     HCloudNode(const Box3f& bbox)
         : bbox(bbox),
-        isLeaf(false)
+        isLeaf(false),
+        lastUsedFrame(0),
+        position(0),
+        intensity(0),
+        coverage(0)
     {
         for (int i = 0; i < 8; ++i)
             children[i] = 0;
@@ -42,26 +53,26 @@ struct HCloudNode
             delete children[i];
     }
 
-    bool isCached() const { return position.get() != 0; }
+    bool isCached() const { return position != 0; }
 
     float radius() const { return bbox.max.x - bbox.min.x; }
 
-    /// Allocate arrays for storing point data
+    /// Size of point data arrays in bytes
     ///
-    /// (TODO: need some sort of LRU cache)
-    void allocateArrays()
+    /// Arrays in a memory mapped file are counted too, as the memory
+    /// they're resident in is only reclaimable once they're freed.
+    uint64_t sizeBytes() const
     {
-        position.reset(new float[3*idata.numPoints]);
-        intensity.reset(new float[idata.numPoints]);
-        if (idata.flags == IndexFlags_Voxels)
-            coverage.reset(new float[idata.numPoints]);
+        int numArrays = (idata.flags == IndexFlags_Voxels) ? 5 : 4;
+        return uint64_t(numArrays)*sizeof(float)*idata.numPoints;
     }
 
     void freeArrays()
     {
-        position.reset();
-        intensity.reset();
-        coverage.reset();
+        position = intensity = coverage = 0;
+        positionStorage.reset();
+        intensityStorage.reset();
+        coverageStorage.reset();
     }
 };
 
@@ -104,10 +115,24 @@ static HCloudNode* readHCloudIndex(std::istream& in, const Box3f& bbox)
 }
 
 
-HCloudView::HCloudView() : m_sizeBytes(0) { }
+HCloudView::HCloudView()
+    : m_sizeBytes(0),
+    m_maxSizeBytes(2000*1024*1024ULL),
+    m_frame(0),
+    m_nodeHits(0),
+    m_nodeLoads(0),
+    m_nodeEvictions(0),
+    m_reportedActivity(0)
+{
+    m_clock.start();
+}
 
 
-HCloudView::~HCloudView() { }
+HCloudView::~HCloudView()
+{
+    // Stop background fetching before the geometry is torn down
+    m_inputCache.reset();
+}
 
 
 bool HCloudView::loadFile(QString fileName, size_t maxVertexCount)
@@ -120,7 +145,24 @@ bool HCloudView::loadFile(QString fileName, size_t maxVertexCount)
                     m_header.boundingBox.max - m_header.offset);
     m_input.seekg(m_header.indexOffset);
     m_rootNode.reset(readHCloudIndex(m_input, offsetBox));
-    m_inputCache.reset(new StreamPageCache(m_input));
+#ifndef _WIN32
+    // Map the file where possible, so the OS does the reading and node
+    // data can be used without copying
+    try
+    {
+        m_inputCache.reset(new StreamPageCache(fileName.toUtf8().constData()));
+    }
+    catch (DisplazError& e)
+    {
+        g_logger.warning("%s, falling back to stream reads", e.what());
+    }
+#endif
+    if (!m_inputCache)
+        m_inputCache.reset(new StreamPageCache(m_input));
+    // Raw pages are only staging for node data, so get a small share of
+    // the memory budget
+    m_inputCache->setMaxSize(m_maxSizeBytes/4);
+    m_inputCache->startBackgroundFetch([this]() { emit dataAvailable(); });
 
 //    fields.push_back(GeomField(TypeSpec::vec3float32(), "position", npoints));
 //    fields.push_back(GeomField(TypeSpec::float32(), "intensity", npoints));
@@ -154,18 +196,18 @@ static void drawBounds(QOpenGLShaderProgram& prog, HCloudNode* node, const Trans
 
 /// Read hcloud point data for node
 ///
-/// If the underlying data isn't cached, return false.
+/// If the underlying data isn't in the page cache, request it with the given
+/// priority and return false.
 static bool readNodeData(HCloudNode* node, const HCloudHeader& header,
                          StreamPageCache& inputCache, double priority)
 {
-    node->allocateArrays();
     uint64_t offset = node->idata.dataOffset;
     PageCacheReader reader(inputCache, offset);
     int numPoints = node->idata.numPoints;
-    reader.read(node->position, 3*numPoints);
+    reader.read(node->position, node->positionStorage, 3*numPoints);
     if (node->idata.flags == IndexFlags_Voxels)
-        reader.read(node->coverage, numPoints);
-    reader.read(node->intensity, numPoints);
+        reader.read(node->coverage, node->coverageStorage, numPoints);
+    reader.read(node->intensity, node->intensityStorage, numPoints);
     if (reader.bad())
     {
         inputCache.prefetch(offset, reader.attemptedBytesRead(), priority);
@@ -176,6 +218,119 @@ static bool readNodeData(HCloudNode* node, const HCloudHeader& header,
 }
 
 
+bool HCloudView::cacheNode(HCloudNode* node, double priority) const
+{
+    node->lastUsedFrame = m_frame;
+    if (node->isCached())
+    {
+        ++m_nodeHits;
+        return true;
+    }
+    if (!readNodeData(node, m_header, *m_inputCache, priority))
+        return false;
+    ++m_nodeLoads;
+    m_sizeBytes += node->sizeBytes();
+    m_cachedNodes.push_back(node);
+    return true;
+}
+
+
+void HCloudView::evictNodes() const
+{
+    // Nodes get whatever part of the budget isn't used by raw pages.  Pages
+    // of a memory mapped file belong to the OS, so don't count.
+    uint64_t pageBytes = m_inputCache->stats().sizeBytes;
+    uint64_t maxNodeBytes = (m_maxSizeBytes > pageBytes) ? m_maxSizeBytes - pageBytes : 0;
+    if (m_sizeBytes <= maxNodeBytes)
+        return;
+    // Evict least recently used nodes first, and finer nodes before their
+    // ancestors.  Nodes used in the current frame are kept, so the view
+    // never loses detail it is drawing.  Evicting children before parents
+    // means a node which is needed again falls back to drawing its parent
+    // LOD until its data is reloaded.
+    std::sort(m_cachedNodes.begin(), m_cachedNodes.end(),
+              [](const HCloudNode* a, const HCloudNode* b)
+              {
+                  if (a->lastUsedFrame != b->lastUsedFrame)
+                      return a->lastUsedFrame < b->lastUsedFrame;
+                  return a->radius() < b->radius();
+              });
+    size_t numEvicted = 0;
+    for (; numEvicted < m_cachedNodes.size() && m_sizeBytes > maxNodeBytes; ++numEvicted)
+    {
+        HCloudNode* node = m_cachedNodes[numEvicted];
+        if (node->lastUsedFrame == m_frame)
+            break;
+        m_sizeBytes -= node->sizeBytes();
+        node->freeArrays();
+    }
+    m_cachedNodes.erase(m_cachedNodes.begin(), m_cachedNodes.begin() + numEvicted);
+    m_nodeEvictions += numEvicted;
+}
+
+
+void HCloudView::prefetchPredicted(const TransformState& transState,
+                                   double angularSizeLimit) const
+{
+    // Estimate camera velocity from its positions over the last half second
+    const double historyLength = 0.5;
+    double time = m_clock.elapsed()/1000.0;
+    V3d cameraPos = transState.cameraPos();
+    m_cameraHistory.push_back(std::make_pair(time, cameraPos));
+    while (time - m_cameraHistory.front().first > historyLength)
+        m_cameraHistory.pop_front();
+    double dt = time - m_cameraHistory.front().first;
+    if (dt < 0.05)
+        return;
+    V3d velocity = (cameraPos - m_cameraHistory.front().second)/dt;
+    if (velocity == V3d(0))
+        return;
+    // Look ahead about as far as it takes to fetch a view's worth of nodes.
+    // Only translation is extrapolated: rotations are usually brief and
+    // reversed, so the current view direction is a better guess.
+    const double lookahead = 1.0;
+    V3d predictedPos = cameraPos + lookahead*velocity;
+    TransformState predictedState = transState.translate(cameraPos - predictedPos);
+    ClipBox clipBox(predictedState);
+
+    // Request nodes of the predicted LOD cut, coarsest first.  Priorities
+    // are offset below those of every request for the current view, and
+    // the total is limited so that predicted pages don't crowd out the
+    // pages needed now.
+    const double priorityOffset = -1e4;
+    const uint64_t maxRequestBytes = m_maxSizeBytes/16;
+    uint64_t requestBytes = 0;
+    typedef std::pair<double, HCloudNode*> PriorityNode;
+    std::priority_queue<PriorityNode> pendingNodes;
+    pendingNodes.push(PriorityNode(DBL_MAX, m_rootNode.get()));
+    while (!pendingNodes.empty() && requestBytes < maxRequestBytes)
+    {
+        HCloudNode* node = pendingNodes.top().second;
+        pendingNodes.pop();
+        if (clipBox.classify(node->bbox) == ClipBox::Outside)
+            continue;
+        double angularSize = node->radius()/(V3d(node->bbox.center()) - predictedPos).length();
+        if (!node->isCached() && node->idata.numPoints > 0 &&
+            !m_inputCache->prefetch(node->idata.dataOffset, node->sizeBytes(),
+                                    priorityOffset + angularSize))
+        {
+            requestBytes += node->sizeBytes();
+        }
+        if (angularSize < angularSizeLimit || node->isLeaf)
+            continue;
+        for (int i = 0; i < 8; ++i)
+        {
+            HCloudNode* n = node->children[i];
+            if (n)
+            {
+                double childSize = n->radius()/(V3d(n->bbox.center()) - predictedPos).length();
+                pendingNodes.push(PriorityNode(childSize, n));
+            }
+        }
+    }
+}
+
+
 void HCloudView::draw(const TransformState& transStateIn, double quality) const
 {
     TransformState transState = transStateIn.translate(offset());
@@ -206,8 +361,11 @@ void HCloudView::draw(const TransformState& transStateIn, double quality) const
     size_t nodesRendered = 0;
     size_t voxelsRendered = 0;
 
-    const size_t fetchQuota = 10;
-    size_t fetchedPages = m_inputCache->fetchNow(fetchQuota);
+    // Pages are fetched in the background.  Requests are renewed below for
+    // nodes which are still wanted; the rest are dropped so that fetching
+    // follows the camera.
+    m_inputCache->discardStaleRequests();
+    ++m_frame;
 
     ClipBox clipBox(transState);
 
@@ -215,16 +373,14 @@ void HCloudView::draw(const TransformState& transStateIn, double quality) const
     const double rootPriority = 1000;
     std::vector<HCloudNode*> nodeStack;
     std::vector<int> levelStack;
-    if (m_rootNode->isCached())
-    {
-        levelStack.push_back(0);
-        nodeStack.push_back(m_rootNode.get());
-    }
-    else if (readNodeData(m_rootNode.get(), m_header, *m_inputCache, rootPriority))
+    // Whether each node is known to be entirely inside the frustum, in
+    // which case its subtree needn't be culled.
+    std::vector<bool> insideStack;
+    if (cacheNode(m_rootNode.get(), rootPriority))
     {
         nodeStack.push_back(m_rootNode.get());
         levelStack.push_back(0);
-        m_sizeBytes += 5*sizeof(float)*m_rootNode->idata.numPoints;
+        insideStack.push_back(false);
     }
     while (!nodeStack.empty())
     {
@@ -232,9 +388,16 @@ void HCloudView::draw(const TransformState& transStateIn, double quality) const
         nodeStack.pop_back();
         int level = levelStack.back();
         levelStack.pop_back();
+        bool inside = insideStack.back();
+        insideStack.pop_back();
 
-        if (clipBox.canCull(node->bbox))
-            continue;
+        if (!inside)
+        {
+            ClipBox::Classification nodeClass = clipBox.classify(node->bbox);
+            if (nodeClass == ClipBox::Outside)
+                continue;
+            inside = nodeClass == ClipBox::Inside;
+        }
 
         double angularSize = node->radius()/(node->bbox.center() - cameraPos).length();
         bool drawNode = angularSize < angularSizeLimit || node->isLeaf;
@@ -245,13 +408,8 @@ void HCloudView::draw(const TransformState& transStateIn, double quality) const
             for (int i = 0; i < 8; ++i)
             {
                 HCloudNode* n = node->children[i];
-                if (n && !n->isCached())
-                {
-                    if (readNodeData(n, m_header, *m_inputCache, angularSize))
-                        m_sizeBytes += 5*sizeof(float)*node->idata.numPoints;
-                    else
-                        drawNode = true;
-                }
+                if (n && !cacheNode(n, angularSize))
+                    drawNode = true;
             }
         }
         if (drawNode)
@@ -284,7 +442,7 @@ void HCloudView::draw(const TransformState& transStateIn, double quality) const
             else
             {
                 prog.setUniformValue("lodMultiplier", GLfloat(0.5*node->radius()/m_header.brickSize));
-                prog.setAttributeArray("coverage",  node->coverage.get(),  1);
+                prog.setAttributeArray("coverage",  node->coverage,  1);
                 // Draw voxels as billboards (not spheres) when drawing MIP
                 // levels: the point radius represents a screen coverage in
                 // this case, with no sensible interpreation as a radius toward
@@ -295,8 +453,8 @@ void HCloudView::draw(const TransformState& transStateIn, double quality) const
             }
             // Debug - draw octree levels
             // prog.setUniformValue("level", level);
-            prog.setAttributeArray("position",  node->position.get(),  3);
-            prog.setAttributeArray("intensity", node->intensity.get(), 1);
+            prog.setAttributeArray("position",  node->position,  3);
+            prog.setAttributeArray("intensity", node->intensity, 1);
             prog.setAttributeArray("simplifyThreshold", m_simplifyThreshold.data(), 1);
             glDrawArrays(GL_POINTS, 0, nvox);
             if (node->idata.flags == IndexFlags_Points)
@@ -313,6 +471,7 @@ void HCloudView::draw(const TransformState& transStateIn, double quality) const
                 {
                     nodeStack.push_back(n);
                     levelStack.push_back(level+1);
+                    insideStack.push_back(inside);
                 }
             }
         }
@@ -326,9 +485,26 @@ void HCloudView::draw(const TransformState& transStateIn, double quality) const
     glDisable(GL_VERTEX_PROGRAM_POINT_SIZE);
     // prog.release();
 
-    g_logger.info("hcloud: %.1fMB, #nodes = %d, fetched pages = %d, mean voxel size = %.0f",
-                  m_sizeBytes/1e6, nodesRendered, fetchedPages,
-                  nodesRendered ? double(voxelsRendered)/nodesRendered : 0.0);
+    prefetchPredicted(transState, angularSizeLimit);
+    evictNodes();
+
+    g_logger.debug("hcloud: #nodes = %d, mean voxel size = %.0f",
+                   nodesRendered, nodesRendered ? double(voxelsRendered)/nodesRendered : 0.0);
+    // Report cache statistics occasionally, and only if they've changed
+    StreamPageCache::Stats pageStats = m_inputCache->stats();
+    uint64_t activity = m_nodeLoads + m_nodeEvictions + pageStats.misses;
+    if (activity != m_reportedActivity &&
+        (!m_statsTimer.isValid() || m_statsTimer.elapsed() > 5000))
+    {
+        g_logger.info("hcloud cache: nodes %.1fMB (%d hits, %d loads, %d evictions); "
+                      "pages %.1fMB + %.1fMB mapped (%d hits, %d misses, %d pending)",
+                      m_sizeBytes/1e6, m_nodeHits, m_nodeLoads, m_nodeEvictions,
+                      pageStats.sizeBytes/1e6, pageStats.mappedBytes/1e6,
+                      pageStats.hits, pageStats.misses,
+                      m_inputCache->pendingCount());
+        m_reportedActivity = activity;
+        m_statsTimer.start();
+    }
 }
 
 
@@ -341,7 +517,8 @@ size_t HCloudView::pointCount() const
 
 void HCloudView::estimateCost(const TransformState& transState,
                               bool incrementalDraw, const double* qualities,
-                              DrawCount* drawCounts, int numEstimates) const
+                              DrawCount* drawCounts, int numEstimates,
+                              const OcclusionMap* occlusion) const
 {
     // FIXME
 }
@@ -351,7 +528,8 @@ bool HCloudView::pickVertex(const V3d& cameraPos,
                             const EllipticalDist& distFunc,
                             V3d& pickedVertex,
                             double* distance,
-                            std::string* info) const
+                            std::string* info,
+                            std::atomic<double>* distBound) const
 {
     // FIXME: Needs full camera transform to calculate angularSizeLimit, as in
     // draw()
@@ -369,6 +547,12 @@ bool HCloudView::pickVertex(const V3d& cameraPos,
         nodeStack.pop_back();
         int level = levelStack.back();
         levelStack.pop_back();
+        if (distBound)
+        {
+            Box3d bbox(offset() + node->bbox.min, offset() + node->bbox.max);
+            if (distFunc.boundNearest(bbox) > distBound->load())
+                continue;
+        }
         double angularSize = node->radius()/(node->bbox.center() + offset() - cameraPos).length();
         bool useNode = angularSize < angularSizeLimit || node->isLeaf;
         if (!useNode)
@@ -386,13 +570,15 @@ bool HCloudView::pickVertex(const V3d& cameraPos,
         if (useNode)
         {
             double dist = DBL_MAX;
-            const V3f* P = reinterpret_cast<const V3f*>(node->position.get());
+            const V3f* P = reinterpret_cast<const V3f*>(node->position);
             size_t idx = distFunc.findNearest(offset(), P, node->idata.numPoints, &dist);
             if (dist < minDist)
             {
                 minDist = dist;
                 pickedVertex = V3d(P[idx]) + offset();
                 foundVertex = true;
+                if (distBound)
+                    atomicMin(*distBound, dist);
             }
         }
         else
@@ -408,6 +594,8 @@ bool HCloudView::pickVertex(const V3d& cameraPos,
             }
         }
     }
+    if (distance)
+        *distance = minDist;
     return foundVertex;
 }
 
@@ -5,7 +5,11 @@
 #ifndef DISPLAZ_HCLOUDVIEW_H_INCLUDED
 #define DISPLAZ_HCLOUDVIEW_H_INCLUDED
 
+#include <deque>
 #include <fstream>
+#include <vector>
+
+#include <QElapsedTimer>
 
 #include "Geometry.h"
 #include "hcloud.h"
@@ -36,20 +40,48 @@ class HCloudView : public Geometry
 
         virtual void estimateCost(const TransformState& transState,
                                   bool incrementalDraw, const double* qualities,
-                                  DrawCount* drawCounts, int numEstimates) const;
+                                  DrawCount* drawCounts, int numEstimates,
+                                  const OcclusionMap* occlusion) const;
 
         virtual bool pickVertex(const V3d& cameraPos,
                                 const EllipticalDist& distFunc,
                                 V3d& pickedVertex,
                                 double* distance = 0,
-                                std::string* info = 0) const;
+                                std::string* info = 0,
+                                std::atomic<double>* distBound = 0) const;
 
 
     private:
+        /// Make node data available for drawing, reading it from the page
+        /// cache if necessary.  Return false if the data isn't available
+        /// yet, in which case it's requested with the given priority.
+        bool cacheNode(HCloudNode* node, double priority) const;
+        /// Free least recently used node data until the node arrays and
+        /// page cache together fit within m_maxSizeBytes
+        void evictNodes() const;
+        /// Request data for the nodes which will be needed if the camera
+        /// continues moving as it has been, at lower priority than data
+        /// needed for the current view
+        void prefetchPredicted(const TransformState& transState,
+                               double angularSizeLimit) const;
+
         HCloudHeader m_header; // TODO: Put in HCloudInput class
         // TODO: Do we really want all this mutable state?
         // Should draw() be logically non-const?
-        mutable uint64_t m_sizeBytes;
+        mutable uint64_t m_sizeBytes;  ///< Size of cached node data
+        uint64_t m_maxSizeBytes;       ///< Memory budget for nodes and pages
+        mutable uint64_t m_frame;
+        mutable std::vector<HCloudNode*> m_cachedNodes;
+        // Cache statistics
+        mutable uint64_t m_nodeHits;
+        mutable uint64_t m_nodeLoads;
+        mutable uint64_t m_nodeEvictions;
+        mutable uint64_t m_reportedActivity;
+        mutable QElapsedTimer m_statsTimer;
+        // Clock, and recent camera positions with their times in seconds,
+        // for predicting camera motion
+        QElapsedTimer m_clock;
+        mutable std::deque<std::pair<double, V3d>> m_cameraHistory;
         mutable std::ifstream m_input;
         mutable std::unique_ptr<StreamPageCache> m_inputCache;
         std::unique_ptr<HCloudNode> m_rootNode;
@@ -0,0 +1,125 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#include "OcclusionMap.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include "TransformState.h"
+
+
+void OcclusionMap::build(const float* depth, int width, int height, int blockSize,
+                         const M44d& viewProjMatrix, const Imath::V2i& viewSize,
+                         bool conservative)
+{
+    m_levels.clear();
+    ++m_generation;
+    if (width <= 0 || height <= 0)
+        return;
+    m_conservative = conservative;
+    m_blockSize = blockSize;
+    m_viewSize = viewSize;
+    m_viewProjMatrix = viewProjMatrix;
+    Level level0;
+    level0.width = width;
+    level0.height = height;
+    level0.depth.assign(depth, depth + size_t(width)*height);
+    m_levels.push_back(std::move(level0));
+    // Reduce by 2x2 maximum down to a single texel.  Odd sized levels are
+    // rounded up, with the last row or column repeated.
+    while (m_levels.back().width > 1 || m_levels.back().height > 1)
+    {
+        const Level& fine = m_levels.back();
+        Level coarse;
+        coarse.width = (fine.width + 1)/2;
+        coarse.height = (fine.height + 1)/2;
+        coarse.depth.resize(size_t(coarse.width)*coarse.height);
+        for (int y = 0; y < coarse.height; ++y)
+        {
+            int y0 = 2*y;
+            int y1 = std::min(2*y + 1, fine.height - 1);
+            for (int x = 0; x < coarse.width; ++x)
+            {
+                int x0 = 2*x;
+                int x1 = std::min(2*x + 1, fine.width - 1);
+                coarse.depth[y*coarse.width + x] =
+                    std::max(std::max(fine.at(x0,y0), fine.at(x1,y0)),
+                             std::max(fine.at(x0,y1), fine.at(x1,y1)));
+            }
+        }
+        m_levels.push_back(std::move(coarse));
+    }
+}
+
+
+void OcclusionMap::clear()
+{
+    m_levels.clear();
+    ++m_generation;
+}
+
+
+bool OcclusionMap::matchesView(const TransformState& transState) const
+{
+    return isValid() && m_conservative && transState.viewSize == m_viewSize &&
+           transState.modelViewMatrix*transState.projMatrix == m_viewProjMatrix;
+}
+
+
+bool OcclusionMap::isOccluded(const Imath::Box3f& box, const M44d& modelViewProj) const
+{
+    if (!isValid() || box.isEmpty())
+        return false;
+    const M44d& M = modelViewProj;
+    // Screen rectangle and nearest depth of the box corners
+    double xmin = DBL_MAX, xmax = -DBL_MAX;
+    double ymin = DBL_MAX, ymax = -DBL_MAX;
+    double zmin = DBL_MAX;
+    for (int i = 0; i < 8; ++i)
+    {
+        double px = (i & 1) ? box.max.x : box.min.x;
+        double py = (i & 2) ? box.max.y : box.min.y;
+        double pz = (i & 4) ? box.max.z : box.min.z;
+        double cw = px*M[0][3] + py*M[1][3] + pz*M[2][3] + M[3][3];
+        // Box crosses the camera plane; it may cover the whole view
+        if (cw <= 0)
+            return false;
+        double cx = px*M[0][0] + py*M[1][0] + pz*M[2][0] + M[3][0];
+        double cy = px*M[0][1] + py*M[1][1] + pz*M[2][1] + M[3][1];
+        double cz = px*M[0][2] + py*M[1][2] + pz*M[2][2] + M[3][2];
+        double x = (0.5*cx/cw + 0.5)*m_viewSize.x;
+        double y = (0.5*cy/cw + 0.5)*m_viewSize.y;
+        xmin = std::min(xmin, x);  xmax = std::max(xmax, x);
+        ymin = std::min(ymin, y);  ymax = std::max(ymax, y);
+        zmin = std::min(zmin, 0.5*cz/cw + 0.5);
+    }
+    // Nothing is known about parts of the box outside the view, or in front
+    // of the near plane
+    if (xmin < 0 || ymin < 0 || xmax > m_viewSize.x || ymax > m_viewSize.y ||
+        zmin <= 0)
+        return false;
+    // Texel range in the finest level
+    const Level& level0 = m_levels[0];
+    int tx0 = std::min((int)(xmin/m_blockSize), level0.width - 1);
+    int tx1 = std::min((int)(xmax/m_blockSize), level0.width - 1);
+    int ty0 = std::min((int)(ymin/m_blockSize), level0.height - 1);
+    int ty1 = std::min((int)(ymax/m_blockSize), level0.height - 1);
+    // Find the finest level where the rectangle covers at most 2x2 texels
+    size_t levelIdx = 0;
+    while (levelIdx + 1 < m_levels.size() && (tx1 - tx0 > 1 || ty1 - ty0 > 1))
+    {
+        ++levelIdx;
+        tx0 >>= 1;  tx1 >>= 1;
+        ty0 >>= 1;  ty1 >>= 1;
+    }
+    const Level& level = m_levels[levelIdx];
+    float maxDepth = 0;
+    for (int ty = ty0; ty <= ty1; ++ty)
+        for (int tx = tx0; tx <= tx1; ++tx)
+            maxDepth = std::max(maxDepth, level.at(tx, ty));
+    // Allow for rounding of depths to the depth buffer precision
+    const double depthTolerance = 1e-6;
+    return zmin > maxDepth + depthTolerance;
+}
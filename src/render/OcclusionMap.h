@@ -0,0 +1,78 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "util.h"
+
+struct TransformState;
+
+//------------------------------------------------------------------------------
+/// Depth pyramid of a previously drawn frame, for occlusion culling on the CPU
+///
+/// Each texel of the finest level holds the maximum (farthest) window space
+/// depth of a block of pixels, and each coarser level holds the maximum of
+/// 2x2 texels of the level below.  A box is occluded when its nearest depth
+/// is farther than the maximum depth over its screen rectangle.  Pixels
+/// where nothing was drawn have depth one, so the test is conservative for
+/// the view the map was made from.
+///
+/// The map may come from an earlier camera position, in which case boxes
+/// are projected with the old camera.  The result is then only a guess, and
+/// callers should be prepared to draw the box in a later frame.
+class OcclusionMap
+{
+    public:
+        /// Build the pyramid from a `width` x `height` image of maximum
+        /// depths, where each texel covers `blockSize` x `blockSize` pixels
+        /// of a frame with size `viewSize` drawn with `viewProjMatrix`.
+        /// Rows of `depth` are ordered from bottom to top as in OpenGL.
+        ///
+        /// `conservative` should be false if the frame holds approximate
+        /// depths, such as reprojected pixels, which may hide points which
+        /// are really visible.
+        void build(const float* depth, int width, int height, int blockSize,
+                   const M44d& viewProjMatrix, const Imath::V2i& viewSize,
+                   bool conservative = true);
+
+        /// Remove any depth information, so that nothing is occluded
+        void clear();
+
+        bool isValid() const { return !m_levels.empty(); }
+
+        /// Identifier which changes whenever the map is rebuilt
+        uint64_t generation() const { return m_generation; }
+
+        /// Transformation from world to clip coordinates of the view the
+        /// map was made from
+        const M44d& viewProjMatrix() const { return m_viewProjMatrix; }
+
+        /// Return true if the map was made from the view of `transState`
+        /// with exact depths, so that occlusion results are conservative
+        bool matchesView(const TransformState& transState) const;
+
+        /// Return true if `box` is certainly hidden in the map's view.
+        /// `modelViewProj` transforms the box to clip coordinates, and
+        /// should be viewProjMatrix() combined with any model transformation.
+        bool isOccluded(const Imath::Box3f& box, const M44d& modelViewProj) const;
+
+    private:
+        struct Level
+        {
+            int width;
+            int height;
+            std::vector<float> depth;
+
+            float at(int x, int y) const { return depth[y*width + x]; }
+        };
+
+        std::vector<Level> m_levels;
+        int m_blockSize = 1;
+        Imath::V2i m_viewSize = Imath::V2i(0);
+        M44d m_viewProjMatrix;
+        bool m_conservative = false;
+        uint64_t m_generation = 0;
+};
@@ -3,12 +3,19 @@
 
 #pragma once
 
+#include <cfloat>
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <queue>
 #include <vector>
 
 #include "util.h"
 #include "glutil.h"
+#include "ClipBox.h"
 #include "GeomField.h"
+#include "PointPickIndex.h"
 
 //------------------------------------------------------------------------------
 /// Functor to compute octree child node index with respect to some given split
@@ -38,10 +45,15 @@ struct OctreeNode
     Imath::Box3f bbox;       ///< Actual bounding box of points in node
     V3f center;              ///< center of the node
     float halfWidth;         ///< Half the axis-aligned width of the node.
+    float pointSpacing;      ///< Typical distance between neighbouring points
+    /// Owned index for picking, or null while not yet built.  Published by
+    /// a background thread, see PointArray::startPickIndexBuild().
+    std::atomic<const PointPickIndex*> pickIndex;
 
     OctreeNode(const V3f& center, float halfWidth)
         : beginIndex(0), endIndex(0), nextBeginIndex(0),
-        center(center), halfWidth(halfWidth)
+        center(center), halfWidth(halfWidth), pointSpacing(0),
+        pickIndex(nullptr)
     {
         std::fill(children, children + 8, nullptr);
     }
@@ -49,51 +61,315 @@ struct OctreeNode
     ~OctreeNode()
     {
         std::for_each(children, children + 8, [](auto v) { delete v; });
+        delete pickIndex.load();
     }
 
+    /// Find the point of the node nearest to the origin of `distFunc`.
+    ///
+    /// Points further than `maxDist` may be ignored, in which case the
+    /// returned `dist` is DBL_MAX.  The pick index is used if available.
     size_t findNearest(const EllipticalDist& distFunc,
                        const V3d& offset, const V3f* p,
-                       double& dist) const
+                       double maxDist, double& dist) const
     {
-         return beginIndex + distFunc.findNearest(offset, p + beginIndex,
-                                                  endIndex - beginIndex,
-                                                  &dist);
+        const PointPickIndex* index = pickIndex.load(std::memory_order_acquire);
+        if (index)
+        {
+            size_t idx = index->findNearest(distFunc, offset, p + beginIndex,
+                                            maxDist, dist);
+            return (idx == size_t(-1)) ? idx : beginIndex + idx;
+        }
+        return beginIndex + distFunc.findNearest(offset, p + beginIndex,
+                                                 endIndex - beginIndex,
+                                                 &dist);
     }
 
+    /// Number of points held directly by this node
+    ///
+    /// For interior nodes these are a representative subsample of the points
+    /// in the whole subtree; the remaining points are held by the children.
     size_t size() const { return endIndex - beginIndex; }
 
-    bool isLeaf() const { return beginIndex != endIndex; }
+    bool isLeaf() const
+    {
+        return std::all_of(children, children + 8, [](auto c) { return !c; });
+    }
 
-    /// Estimate cost of drawing a single leaf node with to given camera
-    /// position, quality, and incremental settings.
+    /// Estimate the typical spacing between neighbouring points in the node.
     ///
-    /// Returns estimate of primitive draw count and whether there's anything
-    /// more to draw.
-    DrawCount drawCount(const V3f& relCamera,
-                        double quality, bool incrementalDraw) const
+    /// Lidar points mostly sample surfaces, so assume the points are spread
+    /// over an area given by the two largest dimensions of the bounding box.
+    void computePointSpacing()
+    {
+        if (size() == 0)
+        {
+            pointSpacing = 0;
+            return;
+        }
+        V3f s = bbox.size();
+        float d[3] = {s.x, s.y, s.z};
+        std::sort(d, d + 3);
+        float n = (float)size();
+        // Fall back to linear spacing for points lying along a line
+        pointSpacing = (d[1] > 0) ? sqrt(d[1]*d[2]/n) : d[2]/n;
+    }
+
+    /// Return the fraction of the node's own points which should be drawn
+    /// to give approximately one point per screen pixel.
+    ///
+    /// The fraction for a given quality is `quality*lodScale(...)`.
+    /// `pixelScale` and `orthographic` come from the camera projection (see
+    /// TransformState::pixelScale()).  The result may be larger than one,
+    /// indicating that the node is too coarse for the current view.
+    double lodScale(const V3f& relCamera, double pixelScale, bool orthographic) const
+    {
+        // Spacing between neighbouring points on screen, in pixels
+        double pixelSpacing = pointSpacing*pixelScale;
+        if (!orthographic)
+        {
+            double dist = distance(relCamera);
+            if (dist <= 0)
+                return DBL_MAX;
+            pixelSpacing /= dist;
+        }
+        return pixelSpacing*pixelSpacing;
+    }
+
+    /// Approximate distance from `relCamera` to the closest point in the node
+    double distance(const V3f& relCamera) const
     {
-        assert(isLeaf());
-        const double drawAllDist = 100;
         double dist = (this->bbox.center() - relCamera).length();
         double diagRadius = this->bbox.size().length()/2;
         // Subtract bucket diagonal dist, since we really want an approx
         // distance to closest point in the bucket, rather than dist to center.
-        dist = std::max(10.0, dist - diagRadius);
-        double desiredFraction = std::min(1.0, quality*pow(drawAllDist/dist, 2));
-        size_t chunkSize = (size_t)ceil(this->size()*desiredFraction);
+        return dist - diagRadius;
+    }
+
+    /// Estimate cost of drawing the points held directly by this node, given
+    /// the desired fraction of points (see lodScale()) and incremental
+    /// settings.  At most `maxVertices` points will be drawn.
+    ///
+    /// Returns estimate of primitive draw count and whether there's anything
+    /// more to draw.
+    DrawCount drawCount(double lodFraction, bool incrementalDraw,
+                        size_t maxVertices = SIZE_MAX) const
+    {
+        double desiredFraction = std::min(1.0, lodFraction);
+        size_t chunkSize = std::max<size_t>(1, (size_t)ceil(this->size()*desiredFraction));
+        chunkSize = std::min(chunkSize, maxVertices);
+        size_t drawBegin = incrementalDraw ? this->nextBeginIndex : this->beginIndex;
+        size_t numVertices = (drawBegin >= this->endIndex) ? 0 :
+                             std::min(chunkSize, this->endIndex - drawBegin);
         DrawCount drawCount;
-        drawCount.numVertices = chunkSize;
-        if (incrementalDraw)
+        drawCount.numVertices = numVertices;
+        drawCount.numDrawCalls = (numVertices > 0) ? 1 : 0;
+        // Anything left in this node after drawing implies that the children
+        // (if any) also won't be drawn.
+        drawCount.moreToDraw = drawBegin + numVertices < this->endIndex;
+        return drawCount;
+    }
+
+    /// Return true if the children should be drawn in addition to the
+    /// `nodeCount` points which will be drawn from this node.
+    ///
+    /// Children are visited once all the node's own points are drawn, which
+    /// happens when the node is too coarse for the view, or after enough
+    /// incremental frames.  This keeps the set of visited nodes monotonic
+    /// over a sequence of incremental frames.
+    bool shouldRefine(const DrawCount& nodeCount, bool incrementalDraw) const
+    {
+        size_t drawBegin = incrementalDraw ? nextBeginIndex : beginIndex;
+        return drawBegin + (size_t)nodeCount.numVertices >= endIndex;
+    }
+
+    /// Reset incremental drawing state of the child nodes
+    ///
+    /// Must be called for nodes which aren't refined when drawing, so that
+    /// children first visited in a later incremental frame start drawing
+    /// from the beginning.
+    void resetChildren() const
+    {
+        for (auto c : children)
         {
-            drawCount.numVertices = (this->nextBeginIndex >= this->endIndex) ? 0 :
-                std::min(chunkSize, this->endIndex - this->nextBeginIndex);
+            if (c)
+                c->nextBeginIndex = c->beginIndex;
         }
-        drawCount.moreToDraw = this->nextBeginIndex < this->endIndex;
-        return drawCount;
     }
 };
 
 
+/// Octree node inside the view frustum, along with per-view level of detail
+/// inputs.  Lists of these are stored in depth first order so that subtrees
+/// are contiguous.
+struct VisibleOctreeNode
+{
+    const OctreeNode* node;
+    size_t subtreeEnd;  ///< List index just past the node's visible subtree
+    double lodScale;    ///< Fraction of points to draw at unit quality
+    double distance;    ///< Approximate distance from camera
+
+    VisibleOctreeNode(const OctreeNode* node, double lodScale, double distance)
+        : node(node), subtreeEnd(0), lodScale(lodScale), distance(distance)
+    { }
+};
+
+
+/// Append `node` and its descendants which aren't culled by `clipBox` to
+/// `visible`, in depth first order.
+///
+/// `node` itself must be visible; `inside` indicates that it's entirely
+/// inside the frustum so that its subtree needs no further culling.
+void appendVisibleNodes(const OctreeNode* node, bool inside, const ClipBox& clipBox,
+                        const V3f& relCamera, double pixelScale, bool orthographic,
+                        std::vector<VisibleOctreeNode>& visible)
+{
+    size_t nodeIdx = visible.size();
+    visible.push_back(VisibleOctreeNode(node, node->lodScale(relCamera, pixelScale, orthographic),
+                                        node->distance(relCamera)));
+    // Classify all children in a single batch
+    const OctreeNode* children[8];
+    Imath::Box3f childBoxes[8];
+    ClipBox::Classification childClasses[8];
+    int numChildren = 0;
+    for (auto c : node->children)
+    {
+        if (!c)
+            continue;
+        children[numChildren] = c;
+        childBoxes[numChildren] = c->bbox;
+        childClasses[numChildren] = ClipBox::Inside;
+        ++numChildren;
+    }
+    if (!inside)
+        clipBox.classify(childBoxes, numChildren, childClasses);
+    for (int i = 0; i < numChildren; ++i)
+    {
+        if (childClasses[i] != ClipBox::Outside)
+        {
+            appendVisibleNodes(children[i], childClasses[i] == ClipBox::Inside,
+                               clipBox, relCamera, pixelScale, orthographic, visible);
+        }
+    }
+    visible[nodeIdx].subtreeEnd = visible.size();
+}
+
+
+/// Append nodes under `root` which aren't culled by `clipBox` to `visible`,
+/// in depth first order.
+void findVisibleNodes(const OctreeNode* root, const ClipBox& clipBox,
+                      const V3f& relCamera, double pixelScale, bool orthographic,
+                      std::vector<VisibleOctreeNode>& visible)
+{
+    ClipBox::Classification rootClass = clipBox.classify(root->bbox);
+    if (rootClass == ClipBox::Outside)
+        return;
+    appendVisibleNodes(root, rootClass == ClipBox::Inside, clipBox,
+                       relCamera, pixelScale, orthographic, visible);
+}
+
+
+/// Visit the nodes of `visible` (see findVisibleNodes()) in order of
+/// importance, with a global budget of `maxVertices` points.
+///
+/// Nodes nearer to the camera are more important: they cover more of the
+/// screen and tend to occlude what's behind them, so the resulting draw order
+/// is approximately front to back.  Children are only visited when their
+/// parent is refined (see OctreeNode::shouldRefine()).  Once the budget is
+/// exhausted the remaining, least important, nodes are still visited with a
+/// zero draw count so that `moreToDraw` is reported correctly.
+///
+/// Nodes for which `isOccluded(index)` returns true are hidden behind
+/// previously drawn geometry.  They're visited with an empty draw count, and
+/// their children are skipped.  When `occlusionFinal` is false the occlusion
+/// test may be out of date, so hidden nodes report that there's more to draw
+/// and will be tested again in the next incremental frame.
+///
+/// `visitFunc(visNode, nodeDrawCount, refine)` is called for each node.
+template<typename OccludedFuncT, typename VisitFuncT>
+void traverseByPriority(const std::vector<VisibleOctreeNode>& visible,
+                        double quality, bool incrementalDraw,
+                        size_t maxVertices, OccludedFuncT isOccluded,
+                        bool occlusionFinal, VisitFuncT visitFunc)
+{
+    if (visible.empty())
+        return;
+    // Min-heap of (distance, index into visible)
+    typedef std::pair<double, size_t> QueueEntry;
+    std::priority_queue<QueueEntry, std::vector<QueueEntry>,
+                        std::greater<QueueEntry>> queue;
+    queue.push(QueueEntry(visible[0].distance, 0));
+    size_t remaining = maxVertices;
+    while (!queue.empty())
+    {
+        size_t i = queue.top().second;
+        queue.pop();
+        const VisibleOctreeNode& visNode = visible[i];
+        if (isOccluded(i))
+        {
+            DrawCount hiddenDrawCount;
+            hiddenDrawCount.moreToDraw = !occlusionFinal;
+            visitFunc(visNode, hiddenDrawCount, false);
+            continue;
+        }
+        DrawCount nodeDrawCount = visNode.node->drawCount(quality*visNode.lodScale,
+                                                          incrementalDraw, remaining);
+        remaining -= (size_t)nodeDrawCount.numVertices;
+        bool refine = visNode.node->shouldRefine(nodeDrawCount, incrementalDraw);
+        visitFunc(visNode, nodeDrawCount, refine);
+        if (!refine)
+            continue;
+        // Direct children are the visible subtrees immediately following i
+        for (size_t j = i + 1; j < visNode.subtreeEnd; j = visible[j].subtreeEnd)
+            queue.push(QueueEntry(visible[j].distance, j));
+    }
+}
+
+
+/// Append indices of all points held by `node` and its descendants to
+/// `indices`
+void appendSubtreeIndices(const OctreeNode* node, std::vector<size_t>& indices)
+{
+    for (size_t i = node->beginIndex; i < node->endIndex; ++i)
+        indices.push_back(i);
+    for (auto c : node->children)
+    {
+        if (c)
+            appendSubtreeIndices(c, indices);
+    }
+}
+
+
+/// Append indices of the points under `node` which are inside `region` to
+/// `indices`.
+///
+/// `region.classify(box)` must return the ClipBox::Classification of a node
+/// bounding box, and `region.contains(p)` whether a point is inside.  Points
+/// of nodes entirely inside the region are added without testing.
+template<typename RegionT>
+void findPointsInRegion(const OctreeNode* node, const V3f* P, const RegionT& region,
+                        std::vector<size_t>& indices)
+{
+    ClipBox::Classification nodeClass = region.classify(node->bbox);
+    if (nodeClass == ClipBox::Outside)
+        return;
+    if (nodeClass == ClipBox::Inside)
+    {
+        appendSubtreeIndices(node, indices);
+        return;
+    }
+    for (size_t i = node->beginIndex; i < node->endIndex; ++i)
+    {
+        if (region.contains(P[i]))
+            indices.push_back(i);
+    }
+    for (auto c : node->children)
+    {
+        if (c)
+            findPointsInRegion(c, P, region, indices);
+    }
+}
+
+
 struct ProgressFunc
 {
     PointArray& points;
@@ -112,10 +388,14 @@ struct ProgressFunc
 ///
 /// The points for consideration in the current node are the set
 /// P[inds[beginIndex..endIndex]]; the tree building process sorts the inds
-/// array in place so that points for the output leaf nodes are held in
-/// the range P[inds[node.beginIndex, node.endIndex)]].  center is the central
-/// split point for splitting children of the current node; radius is the
-/// current node radius measured along one of the axes.
+/// array in place so that points for each output node are held in the range
+/// P[inds[node.beginIndex, node.endIndex)]].  center is the central split
+/// point for splitting children of the current node; radius is the current
+/// node radius measured along one of the axes.
+///
+/// Interior nodes hold a stratified subsample of the points in their subtree
+/// as a coarse level of detail; these points are not repeated in the
+/// children.
 OctreeNode* makeTree(int depth, size_t* inds,
                      size_t beginIndex, size_t endIndex,
                      const V3f* P, const V3f& center,
@@ -128,23 +408,34 @@ OctreeNode* makeTree(int depth, size_t* inds,
     // space.  floats effectively have 24 bit of precision in the
     // mantissa, so there's never any point splitting more than 24 times.
     const int maxDepth = 24;
+    // Number of points held by interior nodes for level of detail.  With
+    // this choice the interior node point spacing is roughly double that of
+    // its children for surface-like data.
+    const size_t pointsPerInteriorNode = pointsPerNode/4;
     size_t* beginPtr = inds + beginIndex;
     size_t* endPtr = inds + endIndex;
     if (endIndex - beginIndex <= pointsPerNode || depth >= maxDepth)
     {
-        static std::random_device rd;
-        static std::mt19937 g(rd());
-        std::shuffle(beginPtr, endPtr, g);
-
-        // Leaf node: set up indices into point list 
+        // Leaf node: set up indices into point list.  Leaf points are put
+        // into stratified order separately, see orderLeafPoints().
         for (size_t i = beginIndex; i < endIndex; ++i)
             node->bbox.extendBy(P[inds[i]]);
         node->beginIndex = beginIndex;
         node->endIndex = endIndex;
+        node->computePointSpacing();
         progressFunc(endIndex - beginIndex);
         return node;
     }
-    // Partition points into the 8 child nodes
+    // Interior node: move a stratified subsample of points to the front of
+    // the range.
+    stratifiedOrder(beginPtr, endIndex - beginIndex, P, pointsPerInteriorNode);
+    node->beginIndex = beginIndex;
+    node->endIndex = beginIndex + pointsPerInteriorNode;
+    for (size_t i = node->beginIndex; i < node->endIndex; ++i)
+        node->bbox.extendBy(P[inds[i]]);
+    progressFunc(pointsPerInteriorNode);
+    beginPtr += pointsPerInteriorNode;
+    // Partition remaining points into the 8 child nodes
     size_t* childRanges[9] = {0};
     multi_partition(beginPtr, endPtr, OctreeChildIdx(P, center), &childRanges[1], 8);
     childRanges[0] = beginPtr;
@@ -163,5 +454,34 @@ OctreeNode* makeTree(int depth, size_t* inds,
                                      childEndIndex, P, c, h, progressFunc);
         node->bbox.extendBy(node->children[i]->bbox);
     }
+    node->computePointSpacing();
     return node;
 }
+
+
+/// Put the points of all leaf nodes under `node` into stratified order, so
+/// that drawing a prefix of a leaf gives even coverage.  The leaves are
+/// processed in parallel.
+void orderLeafPoints(const OctreeNode* node, size_t* inds, const V3f* P)
+{
+    std::vector<const OctreeNode*> leaves;
+    std::vector<const OctreeNode*> nodeStack;
+    nodeStack.push_back(node);
+    while (!nodeStack.empty())
+    {
+        const OctreeNode* n = nodeStack.back();
+        nodeStack.pop_back();
+        if (n->isLeaf())
+            leaves.push_back(n);
+        for (auto c : n->children)
+        {
+            if (c)
+                nodeStack.push_back(c);
+        }
+    }
+    parallelFor(0, leaves.size(), [&](size_t i)
+    {
+        const OctreeNode* leaf = leaves[i];
+        stratifiedOrder(inds + leaf->beginIndex, leaf->size(), P, leaf->size());
+    });
+}
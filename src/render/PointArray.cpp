@@ -13,12 +13,9 @@
 
 #include <functional>
 #include <algorithm>
-#include <numeric>
 #include <unordered_map>
 #include <fstream>
-#include <random>
 #include <queue>
-#include <array>
 
 #include <cfloat>
 
@@ -26,15 +23,18 @@
 
 #include "ClipBox.h"
 #include "OctreeNode.h"
+#include "OcclusionMap.h"
 //------------------------------------------------------------------------------
 // PointArray implementation
 
 PointArray::PointArray()
+    : m_pickIndexCancel(false)
 {
 }
 
 PointArray::~PointArray()
 {
+    stopPickIndexBuild();
 }
 
 /// Load point cloud in text format, assuming fields XYZ
@@ -211,6 +211,8 @@ bool PointArray::loadFile(QString fileName, size_t maxPointCount)
     ProgressFunc progressFunc(*this);
     m_rootNode.reset(makeTree(0, &inds[0], 0, m_npoints, &m_P[0],
                               rootBound.center(), rootRadius, progressFunc));
+    emit loadStepStarted("Ordering points");
+    orderLeafPoints(m_rootNode.get(), &inds[0], &m_P[0]);
     // Reorder point fields into octree order
     emit loadStepStarted("Reordering fields");
     for (size_t i = 0; i < m_fields.size(); ++i)
@@ -228,10 +230,72 @@ bool PointArray::loadFile(QString fileName, size_t maxPointCount)
     emit loadProgress(int(100));
     emit loadStepComplete();
 
+    startPickIndexBuild();
     return true;
 }
 
 
+/// Build pick indices for the octree nodes in a background thread, so that
+/// loading isn't delayed.  Nodes are picked by brute force until their
+/// index becomes available.
+void PointArray::startPickIndexBuild()
+{
+    // Small nodes are searched quickly enough without an index
+    const size_t minIndexedPoints = 1024;
+    stopPickIndexBuild();
+    m_pickIndexCancel = false;
+    m_pickIndexThread = std::thread([this, minIndexedPoints]()
+    {
+        std::vector<OctreeNode*> nodeStack;
+        nodeStack.push_back(m_rootNode.get());
+        while (!nodeStack.empty() && !m_pickIndexCancel)
+        {
+            OctreeNode* node = nodeStack.back();
+            nodeStack.pop_back();
+            if (node->size() >= minIndexedPoints && !node->pickIndex.load())
+            {
+                PointPickIndex* index = new PointPickIndex();
+                index->build(m_P + node->beginIndex, node->size());
+                node->pickIndex.store(index, std::memory_order_release);
+            }
+            for (auto c : node->children)
+            {
+                if (c)
+                    nodeStack.push_back(c);
+            }
+        }
+    });
+}
+
+
+void PointArray::stopPickIndexBuild()
+{
+    m_pickIndexCancel = true;
+    if (m_pickIndexThread.joinable())
+        m_pickIndexThread.join();
+}
+
+
+/// Remove all pick indices; the index build must be stopped.
+void PointArray::clearPickIndex()
+{
+    std::vector<OctreeNode*> nodeStack;
+    if (m_rootNode)
+        nodeStack.push_back(m_rootNode.get());
+    while (!nodeStack.empty())
+    {
+        OctreeNode* node = nodeStack.back();
+        nodeStack.pop_back();
+        delete node->pickIndex.exchange(nullptr);
+        for (auto c : node->children)
+        {
+            if (c)
+                nodeStack.push_back(c);
+        }
+    }
+}
+
+
 void PointArray::mutate(std::shared_ptr<GeometryMutator> mutator)
 {
     // Now we need to find the matching columns
@@ -255,6 +319,16 @@ void PointArray::mutate(std::shared_ptr<GeometryMutator> mutator)
         }
     }
 
+    // Pick indices depend on point positions, so must be rebuilt if these
+    // change.
+    bool mutatePositions = std::any_of(mutFields.begin(), mutFields.end(),
+        [](const GeomField& f) { return f.name == "position"; });
+    if (mutatePositions)
+    {
+        stopPickIndexBuild();
+        clearPickIndex();
+    }
+
     for (size_t mutFieldIdx = 0; mutFieldIdx < mutFields.size(); ++mutFieldIdx)
     {
         if (mutFields[mutFieldIdx].name == "index")
@@ -314,6 +388,9 @@ void PointArray::mutate(std::shared_ptr<GeometryMutator> mutator)
             }
         }
     }
+
+    if (mutatePositions)
+        startPickIndexBuild();
 }
 
 
@@ -321,13 +398,19 @@ bool PointArray::pickVertex(const V3d& cameraPos,
                             const EllipticalDist& distFunc,
                             V3d& pickedVertex,
                             double* distance,
-                            std::string* info) const
+                            std::string* info,
+                            std::atomic<double>* distBound) const
 {
     if (m_npoints == 0)
         return false;
 
     double closestDist = DBL_MAX;
     size_t closestIdx = 0;
+    // Vertices further than this needn't be considered
+    auto searchBound = [&]()
+    {
+        return distBound ? std::min(closestDist, distBound->load()) : closestDist;
+    };
 
     typedef std::pair<double, const OctreeNode*> PriorityNode;
 
@@ -350,28 +433,27 @@ bool PointArray::pickVertex(const V3d& cameraPos,
     {
         auto nextNode = pendingNodes.top();
         double nextMinDist = nextNode.first;
-        if (nextMinDist > closestDist)
+        if (nextMinDist > searchBound())
             break;
         const OctreeNode* node = nextNode.second;
         pendingNodes.pop();
 
-        if (!node->isLeaf())
+        for (int i = 0; i < 8; ++i)
         {
-            for (int i = 0; i < 8; ++i)
-            {
-                OctreeNode* n = node->children[i];
-                if (n)
-                    pendingNodes.push(makePriortyNode(n));
-            }
+            OctreeNode* n = node->children[i];
+            if (n)
+                pendingNodes.push(makePriortyNode(n));
         }
-        else
+        if (node->size() > 0)
         {
             double dist = 0;
-            size_t idx = node->findNearest(distFunc, offset(), m_P, dist);
+            size_t idx = node->findNearest(distFunc, offset(), m_P, searchBound(), dist);
             if(dist < closestDist)
             {
                 closestDist = dist;
                 closestIdx = idx;
+                if (distBound)
+                    atomicMin(*distBound, dist);
             }
         }
     }
@@ -411,38 +493,293 @@ bool PointArray::pickVertex(const V3d& cameraPos,
 }
 
 
-void PointArray::estimateCost(const TransformState& transState,
-                              bool incrementalDraw, const double* qualities,
-                              DrawCount* drawCounts, int numEstimates) const
+/// Axis aligned box region for findPointsInRegion()
+struct BoxRegion
 {
-    TransformState relativeTrans = transState.translate(offset());
-    V3f relCamera = relativeTrans.cameraPos();
-    ClipBox clipBox(relativeTrans);
+    Box3d box;
 
-    std::vector<const OctreeNode*> nodeStack;
-    nodeStack.push_back(m_rootNode.get());
-    while (!nodeStack.empty())
+    ClipBox::Classification classify(const Box3f& b) const
     {
-        const OctreeNode* node = nodeStack.back();
-        nodeStack.pop_back();
-        if (clipBox.canCull(node->bbox))
-            continue;
-        if (!node->isLeaf())
+        if (b.isEmpty() || b.min.x > box.max.x || b.min.y > box.max.y || b.min.z > box.max.z ||
+            b.max.x < box.min.x || b.max.y < box.min.y || b.max.z < box.min.z)
+            return ClipBox::Outside;
+        return contains(b.min) && contains(b.max) ? ClipBox::Inside : ClipBox::Intersect;
+    }
+
+    bool contains(const V3f& p) const
+    {
+        return p.x >= box.min.x && p.y >= box.min.y && p.z >= box.min.z &&
+               p.x <= box.max.x && p.y <= box.max.y && p.z <= box.max.z;
+    }
+};
+
+
+/// Spherical region for findPointsInRegion()
+struct SphereRegion
+{
+    V3d center;
+    double radius2;
+
+    ClipBox::Classification classify(const Box3f& b) const
+    {
+        if (b.isEmpty())
+            return ClipBox::Outside;
+        // Squared distances to the nearest and farthest points of the box
+        double near2 = 0, far2 = 0;
+        for (int a = 0; a < 3; ++a)
+        {
+            double dmin = b.min[a] - center[a];
+            double dmax = b.max[a] - center[a];
+            if (dmin > 0)
+                near2 += dmin*dmin;
+            else if (dmax < 0)
+                near2 += dmax*dmax;
+            far2 += std::max(dmin*dmin, dmax*dmax);
+        }
+        if (near2 > radius2)
+            return ClipBox::Outside;
+        return (far2 <= radius2) ? ClipBox::Inside : ClipBox::Intersect;
+    }
+
+    bool contains(const V3f& p) const
+    {
+        return (V3d(p) - center).length2() <= radius2;
+    }
+};
+
+
+/// Oriented box region for findPointsInRegion()
+struct OrientedBoxRegion
+{
+    V3d center;
+    V3d axes[3];
+    V3d halfExtent;
+
+    ClipBox::Classification classify(const Box3f& b) const
+    {
+        if (b.isEmpty())
+            return ClipBox::Outside;
+        // Compare the extent of the node box along each box axis.  Testing
+        // only these axes can't show that some intersecting boxes are
+        // outside, but this only costs some extra point tests.
+        V3d bcenter = V3d(b.center()) - center;
+        V3d bhalf = 0.5*V3d(b.size());
+        bool inside = true;
+        for (int i = 0; i < 3; ++i)
+        {
+            double d = std::abs(bcenter.dot(axes[i]));
+            double r = std::abs(axes[i].x)*bhalf.x + std::abs(axes[i].y)*bhalf.y +
+                       std::abs(axes[i].z)*bhalf.z;
+            if (d - r > halfExtent[i])
+                return ClipBox::Outside;
+            if (d + r > halfExtent[i])
+                inside = false;
+        }
+        return inside ? ClipBox::Inside : ClipBox::Intersect;
+    }
+
+    bool contains(const V3f& p) const
+    {
+        V3d v = V3d(p) - center;
+        return std::abs(v.dot(axes[0])) <= halfExtent.x &&
+               std::abs(v.dot(axes[1])) <= halfExtent.y &&
+               std::abs(v.dot(axes[2])) <= halfExtent.z;
+    }
+};
+
+
+void PointArray::findInBox(const Imath::Box3d& box, std::vector<size_t>& indices) const
+{
+    if (m_npoints == 0)
+        return;
+    BoxRegion region;
+    region.box = Box3d(box.min - offset(), box.max - offset());
+    findPointsInRegion(m_rootNode.get(), m_P, region, indices);
+}
+
+
+void PointArray::findInSphere(const V3d& center, double radius,
+                              std::vector<size_t>& indices) const
+{
+    if (m_npoints == 0)
+        return;
+    SphereRegion region;
+    region.center = center - offset();
+    region.radius2 = radius*radius;
+    findPointsInRegion(m_rootNode.get(), m_P, region, indices);
+}
+
+
+void PointArray::findInOrientedBox(const V3d& center, const V3d axes[3],
+                                   const V3d& halfExtent,
+                                   std::vector<size_t>& indices) const
+{
+    if (m_npoints == 0)
+        return;
+    OrientedBoxRegion region;
+    region.center = center - offset();
+    for (int i = 0; i < 3; ++i)
+        region.axes[i] = axes[i].normalized();
+    region.halfExtent = halfExtent;
+    findPointsInRegion(m_rootNode.get(), m_P, region, indices);
+}
+
+
+void PointArray::findNearest(const V3d& pos, size_t k, std::vector<size_t>& indices) const
+{
+    if (m_npoints == 0 || k == 0)
+        return;
+    V3d relPos = pos - offset();
+    auto boxDist2 = [&](const Box3f& b)
+    {
+        double dist2 = 0;
+        for (int a = 0; a < 3; ++a)
+        {
+            double d = std::max(std::max(b.min[a] - relPos[a], relPos[a] - b.max[a]), 0.0);
+            dist2 += d*d;
+        }
+        return dist2;
+    };
+    // Best first search as in pickVertex(), keeping the k nearest points
+    // found so far in a max heap.
+    typedef std::pair<double, const OctreeNode*> PriorityNode;
+    std::priority_queue<PriorityNode, std::vector<PriorityNode>,
+                        std::greater<PriorityNode>> pendingNodes;
+    typedef std::pair<double, size_t> NearPoint;
+    std::priority_queue<NearPoint> nearest;
+    pendingNodes.push(PriorityNode(boxDist2(m_rootNode->bbox), m_rootNode.get()));
+    while (!pendingNodes.empty())
+    {
+        PriorityNode next = pendingNodes.top();
+        if (nearest.size() == k && next.first > nearest.top().first)
+            break;
+        pendingNodes.pop();
+        const OctreeNode* node = next.second;
+        for (size_t i = node->beginIndex; i < node->endIndex; ++i)
         {
-            for (int i = 0; i < 8; ++i)
+            double dist2 = (V3d(m_P[i]) - relPos).length2();
+            if (nearest.size() < k)
+                nearest.push(NearPoint(dist2, i));
+            else if (dist2 < nearest.top().first)
             {
-                OctreeNode* n = node->children[i];
-                if (n)
-                    nodeStack.push_back(n);
+                nearest.pop();
+                nearest.push(NearPoint(dist2, i));
             }
-            continue;
         }
-        for (int i = 0; i < numEstimates; ++i)
+        for (auto c : node->children)
         {
-            drawCounts[i] += node->drawCount(relCamera, qualities[i],
-                                             incrementalDraw);
+            if (c)
+                pendingNodes.push(PriorityNode(boxDist2(c->bbox), c));
         }
     }
+    size_t begin = indices.size();
+    indices.resize(begin + nearest.size());
+    for (size_t i = indices.size(); i > begin; --i)
+    {
+        indices[i-1] = nearest.top().second;
+        nearest.pop();
+    }
+}
+
+
+size_t PointArray::fileIndex(size_t i) const
+{
+    if (!m_fileInds)
+    {
+        m_fileInds.reset(new uint32_t[m_npoints]);
+        for (size_t j = 0; j < m_npoints; ++j)
+            m_fileInds[m_inds[j]] = static_cast<uint32_t>(j);
+    }
+    return m_fileInds[i];
+}
+
+
+/// Find octree nodes which are inside the view frustum for the given
+/// transformation (relative to the point offset).
+///
+/// The result is cached, so the culling traversal happens only once per
+/// camera position, and is shared between estimateCost(), drawPoints() and
+/// any subsequent incremental frames.
+const std::vector<VisibleOctreeNode>& PointArray::visibleNodes(
+        const TransformState& relativeTrans) const
+{
+    if (m_visibleNodesTrans && *m_visibleNodesTrans == relativeTrans)
+        return m_visibleNodes;
+    m_visibleNodesTrans.reset(new TransformState(relativeTrans));
+    m_visibleNodes.clear();
+    m_nodeOcclusion.clear();
+    findVisibleNodes(m_rootNode.get(), ClipBox(relativeTrans),
+                     relativeTrans.cameraPos(), relativeTrans.pixelScale(),
+                     relativeTrans.isOrthographic(), m_visibleNodes);
+    return m_visibleNodes;
+}
+
+
+/// Return the maximum number of points to draw in a frame at the given
+/// quality.
+///
+/// At unit quality the level of detail aims for about one point per pixel
+/// of each node's screen area, but nodes overlap on screen.  The budget
+/// limits this overdraw; when it's exceeded the least important nodes are
+/// truncated and left for later incremental frames.
+static size_t pointBudget(const TransformState& transState, double quality)
+{
+    const double maxOverdraw = 4;
+    double budget = quality*maxOverdraw*transState.viewSize.x*transState.viewSize.y;
+    return (budget >= (double)SIZE_MAX) ? SIZE_MAX : (size_t)std::max(1.0, budget);
+}
+
+
+/// Return true if node `visibleIdx` of m_visibleNodes is hidden in
+/// `occlusion`, where `relViewProj` is the map's view projection relative to
+/// the point offset.  Results are cached until the map or the visible nodes
+/// change, so they're shared between estimateCost() and drawPoints().
+bool PointArray::isNodeOccluded(size_t visibleIdx, const OcclusionMap& occlusion,
+                                const M44d& relViewProj) const
+{
+    if (m_nodeOcclusionMap != &occlusion ||
+        m_nodeOcclusionGeneration != occlusion.generation() ||
+        m_nodeOcclusion.size() != m_visibleNodes.size())
+    {
+        m_nodeOcclusion.assign(m_visibleNodes.size(), OcclusionUnknown);
+        m_nodeOcclusionMap = &occlusion;
+        m_nodeOcclusionGeneration = occlusion.generation();
+    }
+    NodeOcclusion& state = m_nodeOcclusion[visibleIdx];
+    if (state == OcclusionUnknown)
+    {
+        state = occlusion.isOccluded(m_visibleNodes[visibleIdx].node->bbox, relViewProj) ?
+                NodeHidden : NodeVisible;
+    }
+    return state == NodeHidden;
+}
+
+
+void PointArray::estimateCost(const TransformState& transState,
+                              bool incrementalDraw, const double* qualities,
+                              DrawCount* drawCounts, int numEstimates,
+                              const OcclusionMap* occlusion) const
+{
+    const std::vector<VisibleOctreeNode>& visible =
+        visibleNodes(transState.translate(offset()));
+    const size_t perVertexBytes = bytes<size_t>(m_fields.begin(), m_fields.end());
+    M44d relViewProj;
+    if (occlusion)
+        relViewProj = M44d().setTranslation(offset()) * occlusion->viewProjMatrix();
+    bool occlusionFinal = occlusion && occlusion->matchesView(transState);
+    for (int i = 0; i < numEstimates; ++i)
+    {
+        traverseByPriority(visible, qualities[i], incrementalDraw,
+                           pointBudget(transState, qualities[i]),
+            [&](size_t j) { return occlusion && isNodeOccluded(j, *occlusion, relViewProj); },
+            occlusionFinal,
+            [&](const VisibleOctreeNode&, const DrawCount& nodeDrawCount, bool)
+            {
+                drawCounts[i] += nodeDrawCount;
+                drawCounts[i].numBytes += perVertexBytes*nodeDrawCount.numVertices;
+            }
+        );
+    }
 }
 
 
@@ -479,8 +816,124 @@ void PointArray::draw(const TransformState& transState, double quality) const
 {
 }
 
+/// Compute the nodes to draw, and the number of points from each.  Nodes
+/// hidden in `occlusion` (if non-null) are skipped.
+///
+/// This updates the incremental drawing state of the nodes (except for
+/// advancing nextBeginIndex past the drawn points, which happens as they're
+/// drawn) but makes no OpenGL calls, so may be run on a worker thread.
+void PointArray::buildDrawList(const TransformState& transState, double quality,
+                               bool incrementalDraw, const OcclusionMap* occlusion,
+                               DrawList& drawList) const
+{
+    {
+        std::lock_guard<std::mutex> lock(m_drawListMutex);
+        drawList.nodes.clear();
+        drawList.drawCount = DrawCount();
+        drawList.building = true;
+    }
+    TransformState relativeTrans = transState.translate(offset());
+    // Draw points in each bucket, with total number drawn depending on the
+    // projected density of the bucket.  Since the points are in stratified
+    // order, this corresponds to an even simplification of the full point
+    // cloud.  Interior nodes hold a coarse subsample of their subtree, so
+    // traversal stops at nodes which are small enough on screen.  Nodes are
+    // drawn front to back, and distant nodes are truncated first if the
+    // budget runs out.
+    const std::vector<VisibleOctreeNode>& visible = visibleNodes(relativeTrans);
+    if (!incrementalDraw)
+    {
+        for (const auto& visNode : visible)
+            visNode.node->nextBeginIndex = visNode.node->beginIndex;
+    }
+    // Nodes hidden behind geometry drawn in a recent frame are skipped, along
+    // with their subtrees.
+    // If the occlusion map is from the current view, hiding is conservative,
+    // so they're also complete for the purposes of incremental drawing.
+    M44d relViewProj;
+    if (occlusion)
+        relViewProj = M44d().setTranslation(offset()) * occlusion->viewProjMatrix();
+    // Nodes are handed over to drawPoints() in chunks as they're found, so
+    // the nearest ones can be submitted while the traversal continues.  Only
+    // the drawing thread touches nextBeginIndex of handed over nodes; the
+    // traversal never revisits them, and only resets children of nodes which
+    // aren't refined, which are never in the list.
+    const size_t chunkSize = 16;
+    std::vector<std::pair<const OctreeNode*, size_t>> chunk;
+    DrawCount drawCount;
+    auto handOver = [&](bool finished)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_drawListMutex);
+            drawList.nodes.insert(drawList.nodes.end(), chunk.begin(), chunk.end());
+            if (finished)
+            {
+                drawList.drawCount = drawCount;
+                drawList.building = false;
+            }
+        }
+        m_drawListChanged.notify_all();
+        chunk.clear();
+    };
+    traverseByPriority(visible, quality, incrementalDraw,
+                       pointBudget(relativeTrans, quality),
+        [&](size_t i) { return occlusion && isNodeOccluded(i, *occlusion, relViewProj); },
+        occlusion && occlusion->matchesView(transState),
+        [&](const VisibleOctreeNode& visNode, const DrawCount& nodeDrawCount, bool refine)
+        {
+            drawCount += nodeDrawCount;
+            if (!refine)
+                visNode.node->resetChildren();
+            if (nodeDrawCount.numVertices > 0)
+            {
+                chunk.push_back(std::make_pair(visNode.node, (size_t)nodeDrawCount.numVertices));
+                if (chunk.size() >= chunkSize)
+                    handOver(false);
+            }
+        }
+    );
+    handOver(true);
+}
+
+
+void PointArray::schedulePrepareDrawPoints() const
+{
+    std::lock_guard<std::mutex> lock(m_drawListMutex);
+    m_preparedDraw.scheduled = true;
+}
+
+
+void PointArray::prepareDrawPoints(const TransformState& transState, double quality,
+                                   bool incrementalDraw,
+                                   const OcclusionMap* occlusion) const
+{
+    {
+        // Publish the arguments along with an empty list still being built,
+        // so drawPoints() can take nodes as soon as they're handed over.
+        std::lock_guard<std::mutex> lock(m_drawListMutex);
+        m_preparedDraw.scheduled = false;
+        m_preparedDraw.nodes.clear();
+        m_preparedDraw.drawCount = DrawCount();
+        m_preparedDraw.building = (bool)m_rootNode;
+        if (m_rootNode)
+            m_preparedDraw.transState.reset(new TransformState(transState));
+        else
+            m_preparedDraw.transState.reset();
+        m_preparedDraw.quality = quality;
+        m_preparedDraw.incrementalDraw = incrementalDraw;
+        m_preparedDraw.occlusion = occlusion;
+        m_preparedDraw.occlusionGeneration = occlusion ? occlusion->generation() : 0;
+    }
+    m_drawListChanged.notify_all();
+    if (!m_rootNode)
+        return;
+    buildDrawList(transState, quality, incrementalDraw, occlusion, m_preparedDraw);
+}
+
+
 DrawCount PointArray::drawPoints(QOpenGLShaderProgram& prog, const TransformState& transState,
-                                 double quality, bool incrementalDraw) const
+                                 double quality, bool incrementalDraw,
+                                 const OcclusionMap* occlusion) const
 {
     GLuint vao = getVAO("points");
     glBindVertexArray(vao);
@@ -529,105 +982,128 @@ DrawCount PointArray::drawPoints(QOpenGLShaderProgram& prog, const TransformStat
     // Compute number of bytes required to store all attributes of a vertex, in bytes.
     const size_t perVertexBytes = bytes<size_t>(m_fields.begin(), m_fields.end());
 
-    DrawCount drawCount;
-    ClipBox clipBox(relativeTrans);
-
-    std::array<size_t, 8> nodeOrder;
-    std::iota(nodeOrder.begin(), nodeOrder.end(), 0);  // Order does not matter
-
-    // Draw points in each bucket, with total number drawn depending on how far
-    // away the bucket is.  Since the points are shuffled, this corresponds to
-    // a stochastic simplification of the full point cloud.
-    V3f relCamera = relativeTrans.cameraPos();
-    std::vector<const OctreeNode*> nodeStack;
-    nodeStack.push_back(m_rootNode.get());
-    while (!nodeStack.empty())
+    // Upload and draw the given nodes
+    auto drawNodes = [&](const std::vector<std::pair<const OctreeNode*, size_t>>& nodes)
     {
-        const OctreeNode* node = nodeStack.back();
-        nodeStack.pop_back();
-        if (clipBox.canCull(node->bbox))
-            continue;
-        if (!node->isLeaf())
-        {
-            std::for_each(std::begin(nodeOrder), std::end(nodeOrder), [&](const auto& i) { if (node->children[i]) nodeStack.push_back(node->children[i]); });
-            continue;
-        }
-        if (!incrementalDraw)
-            node->nextBeginIndex = node->beginIndex;
-
-        DrawCount nodeDrawCount = node->drawCount(relCamera, quality, incrementalDraw);
-        drawCount += nodeDrawCount;
-
-        if (nodeDrawCount.numVertices == 0)
-            continue;
-
-        if (m_fields.size() < 1)
-            continue;
-
-        // Create a new uninitialized buffer for the current node, reserving
-        // enough space for the entire set of vertex attributes which will be
-        // passed to the shader.
-        //
-        // (This new memory area will be bound to the "point_buffer" VBO until
-        // the memory is orphaned by calling glBufferData() next time through
-        // the loop.  The orphaned memory should be cleaned up by the driver,
-        // and this may actually be quite efficient, see
-        // http://stackoverflow.com/questions/25111565/how-to-deallocate-glbufferdata-memory
-        // http://hacksoflife.blogspot.com.au/2015/06/glmapbuffer-no-longer-cool.html )
-        GLsizeiptr nodeBufferSize = perVertexBytes * nodeDrawCount.numVertices;
-        glBufferData(GL_ARRAY_BUFFER, nodeBufferSize, NULL, GL_STREAM_DRAW);
-
-        GLintptr bufferOffset = 0;
-        for (size_t i = 0, k = 0; i < m_fields.size(); k += m_fields[i].spec.arraySize(), ++i)
+        for (const auto& nodeDraw : nodes)
         {
-            const GeomField& field = m_fields[i];
-            const int arraySize = field.spec.arraySize();
-            const int vecSize = field.spec.vectorSize();
-
-            // TODO?: Could use a single data-array that isn't split into
-            // vertex / normal / color / etc. sections, but has interleaved
-            // data ?  OpenGL has a stride value in glVertexAttribPointer for
-            // exactly this purpose, which should be used for better efficiency
-            // here we write only the current attribute data into this the
-            // buffer (e.g. all positions, then all colors)
-            GLsizeiptr fieldBufferSize = arraySize * vecSize * field.spec.elsize * nodeDrawCount.numVertices;
-
-            // Upload raw data for `field` to the appropriate part of the buffer.
-            char* bufferData = field.data.get() + node->nextBeginIndex*field.spec.size();
-            glBufferSubData(GL_ARRAY_BUFFER, bufferOffset, fieldBufferSize, bufferData);
-
-            // Tell OpenGL how to interpret the buffer of raw data which was
-            // just uploaded.  This should be a single call, but OpenGL spec
-            // insanity says we need `arraySize` calls (though arraySize=1
-            // for most usage.)
-            for (int j = 0; j < arraySize; ++j)
+            const OctreeNode* node = nodeDraw.first;
+            size_t numVertices = nodeDraw.second;
+
+            if (m_fields.size() < 1)
+                continue;
+
+            // Create a new uninitialized buffer for the current node, reserving
+            // enough space for the entire set of vertex attributes which will be
+            // passed to the shader.
+            //
+            // (This new memory area will be bound to the "point_buffer" VBO until
+            // the memory is orphaned by calling glBufferData() next time through
+            // the loop.  The orphaned memory should be cleaned up by the driver,
+            // and this may actually be quite efficient, see
+            // http://stackoverflow.com/questions/25111565/how-to-deallocate-glbufferdata-memory
+            // http://hacksoflife.blogspot.com.au/2015/06/glmapbuffer-no-longer-cool.html )
+            GLsizeiptr nodeBufferSize = perVertexBytes * numVertices;
+            glBufferData(GL_ARRAY_BUFFER, nodeBufferSize, NULL, GL_STREAM_DRAW);
+
+            GLintptr bufferOffset = 0;
+            for (size_t i = 0, k = 0; i < m_fields.size(); k += m_fields[i].spec.arraySize(), ++i)
             {
-                const ShaderAttribute* attr = attributes[k+j];
-                if (!attr)
+                const GeomField& field = m_fields[i];
+                const int arraySize = field.spec.arraySize();
+                const int vecSize = field.spec.vectorSize();
+
+                // TODO?: Could use a single data-array that isn't split into
+                // vertex / normal / color / etc. sections, but has interleaved
+                // data ?  OpenGL has a stride value in glVertexAttribPointer for
+                // exactly this purpose, which should be used for better efficiency
+                // here we write only the current attribute data into this the
+                // buffer (e.g. all positions, then all colors)
+                GLsizeiptr fieldBufferSize = arraySize * vecSize * field.spec.elsize * numVertices;
+
+                // Upload raw data for `field` to the appropriate part of the buffer.
+                char* bufferData = field.data.get() + node->nextBeginIndex*field.spec.size();
+                glBufferSubData(GL_ARRAY_BUFFER, bufferOffset, fieldBufferSize, bufferData);
+
+                // Tell OpenGL how to interpret the buffer of raw data which was
+                // just uploaded.  This should be a single call, but OpenGL spec
+                // insanity says we need `arraySize` calls (though arraySize=1
+                // for most usage.)
+                for (int j = 0; j < arraySize; ++j)
                 {
-                    continue;
+                    const ShaderAttribute* attr = attributes[k+j];
+                    if (!attr)
+                    {
+                        continue;
+                    }
+
+                    GLintptr arrayElementOffset = bufferOffset + j*field.spec.elsize;
+
+                    if (attr->baseType == TypeSpec::Int || attr->baseType == TypeSpec::Uint)
+                    {
+                        glVertexAttribIPointer(attr->location, vecSize, glBaseType(field.spec),
+                                               0, (const GLvoid *)arrayElementOffset);
+                    }
+                    else
+                    {
+                        glVertexAttribPointer(attr->location, vecSize, glBaseType(field.spec),
+                                              field.spec.fixedPoint, 0, (const GLvoid *)arrayElementOffset);
+                    }
                 }
 
-                GLintptr arrayElementOffset = bufferOffset + j*field.spec.elsize;
-
-                if (attr->baseType == TypeSpec::Int || attr->baseType == TypeSpec::Uint)
-                {
-                    glVertexAttribIPointer(attr->location, vecSize, glBaseType(field.spec),
-                                           0, (const GLvoid *)arrayElementOffset);
-                }
-                else
-                {
-                    glVertexAttribPointer(attr->location, vecSize, glBaseType(field.spec),
-                                          field.spec.fixedPoint, 0, (const GLvoid *)arrayElementOffset);
-                }
+                bufferOffset += fieldBufferSize;
             }
 
-            bufferOffset += fieldBufferSize;
+            glDrawArrays(GL_POINTS, 0, (GLsizei)numVertices);
+            node->nextBeginIndex += numVertices;
         }
+    };
+
+    // Use the draw list from prepareDrawPoints() if it's for this frame,
+    // drawing each chunk of nodes as soon as it's handed over.  Otherwise
+    // build the list now.
+    std::unique_lock<std::mutex> lock(m_drawListMutex);
+    m_drawListChanged.wait(lock, [&]() { return !m_preparedDraw.scheduled; });
+    bool usePrepared = m_preparedDraw.transState && *m_preparedDraw.transState == transState &&
+                       m_preparedDraw.quality == quality &&
+                       m_preparedDraw.incrementalDraw == incrementalDraw &&
+                       m_preparedDraw.occlusion == occlusion &&
+                       (!occlusion || m_preparedDraw.occlusionGeneration == occlusion->generation());
+    DrawList localDrawList;
+    if (!usePrepared)
+    {
+        // A prepared build for other arguments may still be running on the
+        // worker, and shares the traversal and occlusion caches and node
+        // drawing state with buildDrawList(), so let it finish first.
+        m_drawListChanged.wait(lock, [&]() { return !m_preparedDraw.building; });
+        lock.unlock();
+        buildDrawList(transState, quality, incrementalDraw, occlusion, localDrawList);
+        lock.lock();
+    }
+    DrawList& drawList = usePrepared ? m_preparedDraw : localDrawList;
 
-        glDrawArrays(GL_POINTS, 0, (GLsizei)nodeDrawCount.numVertices);
-        node->nextBeginIndex += nodeDrawCount.numVertices;
+    std::vector<std::pair<const OctreeNode*, size_t>> chunk;
+    size_t numTaken = 0;
+    while (true)
+    {
+        m_drawListChanged.wait(lock, [&]() { return !drawList.building ||
+                                                    drawList.nodes.size() > numTaken; });
+        if (drawList.nodes.size() == numTaken)
+            break;
+        chunk.assign(drawList.nodes.begin() + numTaken, drawList.nodes.end());
+        numTaken = drawList.nodes.size();
+        lock.unlock();
+        drawNodes(chunk);
+        lock.lock();
+    }
+    DrawCount drawCount = drawList.drawCount;
+    if (usePrepared)
+    {
+        m_preparedDraw.transState.reset();
+        m_preparedDraw.nodes.clear();
     }
+    lock.unlock();
+    drawCount.numBytes = perVertexBytes*drawCount.numVertices;
     //tfm::printf("Drew %d of total points %d, quality %f\n", totDraw, m_npoints, quality);
 
     // Disable all attribute arrays - leaving these enabled seems to screw with
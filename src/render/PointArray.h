@@ -3,9 +3,13 @@
 
 #pragma once
 
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
 #include <cstdint>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include "Geometry.h"
@@ -16,6 +20,7 @@
 class QOpenGLShaderProgram;
 
 struct OctreeNode;
+struct VisibleOctreeNode;
 struct TransformState;
 
 //------------------------------------------------------------------------------
@@ -39,19 +44,60 @@ class PointArray : public Geometry
 
         virtual DrawCount drawPoints(QOpenGLShaderProgram& prog,
                                     const TransformState& transState,
-                                    double quality, bool incrementalDraw) const override;
+                                    double quality, bool incrementalDraw,
+                                    const OcclusionMap* occlusion) const override;
+
+        virtual void prepareDrawPoints(const TransformState& transState, double quality,
+                                       bool incrementalDraw,
+                                       const OcclusionMap* occlusion) const override;
+
+        virtual void schedulePrepareDrawPoints() const override;
 
         virtual size_t pointCount() const { return m_npoints; }
 
         virtual void estimateCost(const TransformState& transState,
                                   bool incrementalDraw, const double* qualities,
-                                  DrawCount* drawCounts, int numEstimates) const;
+                                  DrawCount* drawCounts, int numEstimates,
+                                  const OcclusionMap* occlusion) const;
 
         virtual bool pickVertex(const V3d& cameraPos,
                                 const EllipticalDist& distFunc,
                                 V3d& pickedVertex,
                                 double* distance = 0,
-                                std::string* info = 0) const;
+                                std::string* info = 0,
+                                std::atomic<double>* distBound = 0) const;
+
+        //--------------------------------------------------
+        /// Spatial queries
+        ///
+        /// These find points within a region using the octree, appending
+        /// their indices to `indices`.  Indices refer to the point storage
+        /// order, which is the order of fields(); use fileIndex() to map
+        /// them back to the order of the source file.
+
+        /// Find points inside the axis aligned `box`
+        void findInBox(const Imath::Box3d& box, std::vector<size_t>& indices) const;
+
+        /// Find points within `radius` of `center`
+        void findInSphere(const V3d& center, double radius,
+                          std::vector<size_t>& indices) const;
+
+        /// Find points inside the box with the given `center` and
+        /// orthogonal `axes`, extending `halfExtent[i]` along `axes[i]`
+        void findInOrientedBox(const V3d& center, const V3d axes[3],
+                               const V3d& halfExtent,
+                               std::vector<size_t>& indices) const;
+
+        /// Find the `k` points nearest to `pos`, in order of increasing
+        /// distance
+        void findNearest(const V3d& pos, size_t k, std::vector<size_t>& indices) const;
+
+        /// Return index in the source file of the point with storage
+        /// index `i`
+        size_t fileIndex(size_t i) const;
+
+        /// Point data fields, in storage order
+        const std::vector<GeomField>& fields() const { return m_fields; }
 
         /// Draw a representation of the point hierarchy.
         ///
@@ -73,6 +119,48 @@ class PointArray : public Geometry
 
         friend struct ProgressFunc;
 
+        /// List of nodes and number of points to draw from each, in drawing
+        /// order.  The list is appended to in chunks while it's built, and
+        /// all members are guarded by m_drawListMutex.
+        struct DrawList
+        {
+            std::vector<std::pair<const OctreeNode*, size_t>> nodes;
+            /// Total for the whole list, set once building is finished
+            DrawCount drawCount;
+            /// True while buildDrawList() may append more nodes
+            bool building = false;
+            /// True between schedulePrepareDrawPoints() and the start of
+            /// prepareDrawPoints()
+            bool scheduled = false;
+            /// drawPoints() arguments the list was prepared for
+            std::unique_ptr<TransformState> transState;
+            double quality = 0;
+            bool incrementalDraw = false;
+            const OcclusionMap* occlusion = nullptr;
+            uint64_t occlusionGeneration = 0;
+        };
+
+        /// Occlusion state of a visible node, see isNodeOccluded()
+        enum NodeOcclusion : char
+        {
+            OcclusionUnknown = 0,
+            NodeVisible,
+            NodeHidden
+        };
+
+        const std::vector<VisibleOctreeNode>& visibleNodes(const TransformState& relativeTrans) const;
+
+        bool isNodeOccluded(size_t visibleIdx, const OcclusionMap& occlusion,
+                            const M44d& relViewProj) const;
+
+        void buildDrawList(const TransformState& transState, double quality,
+                           bool incrementalDraw, const OcclusionMap* occlusion,
+                           DrawList& drawList) const;
+
+        void startPickIndexBuild();
+        void stopPickIndexBuild();
+        void clearPickIndex();
+
         /// Total number of loaded points
         size_t m_npoints = 0;
         /// Spatial hierarchy
@@ -83,4 +171,23 @@ class PointArray : public Geometry
         int m_positionFieldIdx = -1;
         V3f* m_P = nullptr;
         std::unique_ptr<uint32_t[]> m_inds;
+        /// Inverse of m_inds, computed when first needed by fileIndex()
+        mutable std::unique_ptr<uint32_t[]> m_fileInds;
+        /// Nodes visible from the most recent camera, shared between
+        /// estimateCost() and drawPoints() (see visibleNodes())
+        mutable std::vector<VisibleOctreeNode> m_visibleNodes;
+        mutable std::unique_ptr<TransformState> m_visibleNodesTrans;
+        /// Cached occlusion of each of m_visibleNodes for the occlusion map
+        /// with generation m_nodeOcclusionGeneration
+        mutable std::vector<NodeOcclusion> m_nodeOcclusion;
+        mutable const OcclusionMap* m_nodeOcclusionMap = nullptr;
+        mutable uint64_t m_nodeOcclusionGeneration = 0;
+        /// Draw list from prepareDrawPoints(), consumed by drawPoints()
+        mutable DrawList m_preparedDraw;
+        mutable std::mutex m_drawListMutex;
+        /// Signalled when a draw list is scheduled, extended or finished
+        mutable std::condition_variable m_drawListChanged;
+        /// Background thread building per node pick indices
+        std::thread m_pickIndexThread;
+        std::atomic<bool> m_pickIndexCancel;
 };
@@ -0,0 +1,68 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#include "PointPickIndex.h"
+
+#include <algorithm>
+
+
+void PointPickIndex::build(const V3f* P, size_t numPoints)
+{
+    m_nodes.clear();
+    m_inds.resize(numPoints);
+    for (size_t i = 0; i < numPoints; ++i)
+        m_inds[i] = (uint32_t)i;
+    if (numPoints == 0)
+        return;
+    m_nodes.reserve(2*numPoints/bucketSize + 1);
+    buildRecursive(P, 0, (uint32_t)numPoints);
+}
+
+
+/// Build the subtree for m_inds[beginIndex:endIndex] by splitting at the
+/// median point along the longest axis of the bounding box.  Return the
+/// index of the subtree root.
+uint32_t PointPickIndex::buildRecursive(const V3f* P, uint32_t beginIndex,
+                                        uint32_t endIndex)
+{
+    uint32_t nodeIndex = (uint32_t)m_nodes.size();
+    m_nodes.push_back(Node());
+    Node node;
+    for (uint32_t j = beginIndex; j < endIndex; ++j)
+        node.bbox.extendBy(P[m_inds[j]]);
+    node.beginIndex = beginIndex;
+    node.endIndex = endIndex;
+    node.secondChild = 0;
+    node.isLeaf = endIndex - beginIndex <= bucketSize;
+    if (!node.isLeaf)
+    {
+        int axis = node.bbox.majorAxis();
+        uint32_t midIndex = beginIndex + (endIndex - beginIndex)/2;
+        std::nth_element(m_inds.begin() + beginIndex, m_inds.begin() + midIndex,
+                         m_inds.begin() + endIndex,
+                         [&](uint32_t a, uint32_t b) { return P[a][axis] < P[b][axis]; });
+        buildRecursive(P, beginIndex, midIndex);
+        node.secondChild = buildRecursive(P, midIndex, endIndex);
+    }
+    m_nodes[nodeIndex] = node;
+    return nodeIndex;
+}
+
+
+size_t PointPickIndex::findNearest(const EllipticalDist& distFunc, const V3d& offset,
+                                   const V3f* P, double maxDist, double& dist) const
+{
+    // Bucket points are gathered into a contiguous array for the vectorized
+    // distance search.
+    V3f bucketPoints[bucketSize];
+    return findNearestInBvh(m_nodes, distFunc, offset, maxDist, dist,
+        [&](const Node& node, double& bucketDist)
+        {
+            uint32_t count = node.endIndex - node.beginIndex;
+            for (uint32_t j = 0; j < count; ++j)
+                bucketPoints[j] = P[m_inds[node.beginIndex + j]];
+            size_t j = distFunc.findNearest(offset, bucketPoints, count, &bucketDist);
+            return (j < count) ? (size_t)m_inds[node.beginIndex + j] : size_t(-1);
+        }
+    );
+}
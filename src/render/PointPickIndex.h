@@ -0,0 +1,51 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "BvhNode.h"
+#include "util.h"
+
+//------------------------------------------------------------------------------
+/// Bounding volume hierarchy over the points held by an octree node, for fast
+/// nearest point picking
+///
+/// Octree nodes hold up to about 100000 points in stratified drawing order,
+/// so searching a node by brute force costs time proportional to its size.
+/// This index sorts a permutation of the points into small spatially
+/// coherent buckets instead, leaving the points themselves in place.  Picks
+/// then only examine the buckets which may contain a point closer than the
+/// best found so far.
+class PointPickIndex
+{
+    public:
+        /// Build the index over points `P[0:numPoints]`
+        void build(const V3f* P, size_t numPoints);
+
+        /// Return number of indexed points
+        size_t size() const { return m_inds.size(); }
+
+        /// Return index of the point of `P[0:size()]` nearest to the origin
+        /// of `distFunc`, where `P` is the array passed to build() and the
+        /// true positions are `P[i] + offset`.
+        ///
+        /// Only points closer than `maxDist` are considered.  If there are
+        /// none, return size_t(-1) and set `dist` to DBL_MAX.
+        size_t findNearest(const EllipticalDist& distFunc, const V3d& offset,
+                           const V3f* P, double maxDist, double& dist) const;
+
+    private:
+        /// Nodes index into m_inds
+        typedef BvhNode Node;
+
+        uint32_t buildRecursive(const V3f* P, uint32_t beginIndex, uint32_t endIndex);
+
+        /// Maximum number of points per leaf bucket
+        static const uint32_t bucketSize = 64;
+
+        std::vector<Node> m_nodes;
+        std::vector<uint32_t> m_inds;
+};
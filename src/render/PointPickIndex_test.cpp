@@ -0,0 +1,81 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#include <catch.hpp>
+
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+#include "PointPickIndex.h"
+
+// gcc 4.6 and 4.7 warns/suggests parentheses around == comparison
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wparentheses"
+#endif
+
+static double randUniform(double a, double b)
+{
+    return a + (b - a)*rand()/double(RAND_MAX);
+}
+
+
+TEST_CASE("PointPickIndex finds the same nearest point as a brute force search")
+{
+    const size_t numPoints = 20000;
+    std::vector<V3f> P(numPoints);
+    for (auto& p : P)
+        p = V3f(randUniform(-100, 100), randUniform(-100, 100), randUniform(0, 20));
+    const V3d offset(500000, 6000000, 100);
+    PointPickIndex index;
+    index.build(P.data(), numPoints);
+    REQUIRE(index.size() == numPoints);
+
+    for (int i = 0; i < 100; ++i)
+    {
+        V3d origin = offset + V3d(randUniform(-150, 150), randUniform(-150, 150),
+                                  randUniform(-50, 500));
+        V3d axis(randUniform(-1, 1), randUniform(-1, 1), randUniform(-1, 1));
+        double scale = (i % 2 == 0) ? 0.01 : 1.0;
+        EllipticalDist distFunc(origin, axis, scale);
+
+        double bruteDist = 0;
+        distFunc.findNearest(offset, P.data(), numPoints, &bruteDist);
+
+        // Unbounded search
+        double dist = 0;
+        size_t idx = index.findNearest(distFunc, offset, P.data(), DBL_MAX, dist);
+        REQUIRE(idx < numPoints);
+        CHECK(dist == Approx(bruteDist));
+        double pointDist = 0;
+        distFunc.findNearest(offset, &P[idx], 1, &pointDist);
+        CHECK(pointDist == Approx(dist));
+
+        // Bound just above the nearest distance still finds it
+        idx = index.findNearest(distFunc, offset, P.data(), 1.01*bruteDist, dist);
+        REQUIRE(idx < numPoints);
+        CHECK(dist == Approx(bruteDist));
+
+        // Bound below the nearest distance finds nothing
+        idx = index.findNearest(distFunc, offset, P.data(), 0.99*bruteDist, dist);
+        CHECK(idx == size_t(-1));
+        CHECK(dist == DBL_MAX);
+    }
+}
+
+
+TEST_CASE("PointPickIndex with few points")
+{
+    PointPickIndex index;
+    EllipticalDist distFunc(V3d(0), V3d(0,0,1), 1);
+    double dist = 0;
+    index.build(0, 0);
+    CHECK(index.findNearest(distFunc, V3d(0), 0, DBL_MAX, dist) == size_t(-1));
+    CHECK(dist == DBL_MAX);
+
+    V3f P[] = {V3f(3,0,0), V3f(1,1,0), V3f(0,0,2)};
+    index.build(P, 3);
+    CHECK(index.findNearest(distFunc, V3d(0), P, DBL_MAX, dist) == 1);
+    CHECK(dist == Approx(sqrt(2.0)));
+}
@@ -0,0 +1,154 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#include "SceneBvh.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "ClipBox.h"
+#include "TransformState.h"
+
+
+/// Convert `box` to single precision relative to `origin`, rounding outward
+/// so that the result always contains the original box.
+static Imath::Box3f relativeBox(const Imath::Box3d& box, const V3d& origin)
+{
+    Imath::Box3f res;
+    for (int a = 0; a < 3; ++a)
+    {
+        double lo = box.min[a] - origin[a];
+        double hi = box.max[a] - origin[a];
+        float flo = (float)lo;
+        float fhi = (float)hi;
+        if (flo > lo)
+            flo = std::nextafter(flo, -INFINITY);
+        if (fhi < hi)
+            fhi = std::nextafter(fhi, INFINITY);
+        res.min[a] = flo;
+        res.max[a] = fhi;
+    }
+    return res;
+}
+
+
+void SceneBvh::clear()
+{
+    m_numItems = 0;
+    m_nodes.clear();
+    m_items.clear();
+    m_itemBoxes.clear();
+    m_unboundedItems.clear();
+}
+
+
+void SceneBvh::build(const std::vector<Imath::Box3d>& boxes)
+{
+    clear();
+    m_numItems = boxes.size();
+    Imath::Box3d totalBox;
+    for (size_t i = 0; i < boxes.size(); ++i)
+    {
+        if (boxes[i].isEmpty())
+        {
+            m_unboundedItems.push_back((uint32_t)i);
+            continue;
+        }
+        m_items.push_back((uint32_t)i);
+        totalBox.extendBy(boxes[i]);
+    }
+    if (m_items.empty())
+        return;
+    m_origin = totalBox.center();
+    std::vector<V3d> centers(boxes.size());
+    for (uint32_t i : m_items)
+        centers[i] = boxes[i].center();
+    m_nodes.reserve(2*m_items.size()/leafSize + 1);
+    buildRecursive(boxes, centers, 0, (uint32_t)m_items.size());
+    m_itemBoxes.resize(m_items.size());
+    for (size_t j = 0; j < m_items.size(); ++j)
+        m_itemBoxes[j] = relativeBox(boxes[m_items[j]], m_origin);
+}
+
+
+/// Build the subtree for m_items[beginItem:endItem] by splitting at the
+/// median item center along the longest axis of the centers.  Return the
+/// index of the subtree root.
+uint32_t SceneBvh::buildRecursive(const std::vector<Imath::Box3d>& boxes,
+                                  const std::vector<V3d>& centers,
+                                  uint32_t beginItem, uint32_t endItem)
+{
+    uint32_t nodeIndex = (uint32_t)m_nodes.size();
+    m_nodes.push_back(Node());
+    Imath::Box3d bbox;
+    Imath::Box3d centerBox;
+    for (uint32_t j = beginItem; j < endItem; ++j)
+    {
+        bbox.extendBy(boxes[m_items[j]]);
+        centerBox.extendBy(centers[m_items[j]]);
+    }
+    Node node;
+    node.bbox = relativeBox(bbox, m_origin);
+    node.beginIndex = beginItem;
+    node.endIndex = endItem;
+    node.secondChild = 0;
+    node.isLeaf = endItem - beginItem <= leafSize;
+    if (!node.isLeaf)
+    {
+        int axis = centerBox.majorAxis();
+        uint32_t midItem = beginItem + (endItem - beginItem)/2;
+        std::nth_element(m_items.begin() + beginItem, m_items.begin() + midItem,
+                         m_items.begin() + endItem,
+                         [&](uint32_t a, uint32_t b) { return centers[a][axis] < centers[b][axis]; });
+        buildRecursive(boxes, centers, beginItem, midItem);
+        node.secondChild = buildRecursive(boxes, centers, midItem, endItem);
+    }
+    m_nodes[nodeIndex] = node;
+    return nodeIndex;
+}
+
+
+void SceneBvh::findVisible(const TransformState& transState,
+                           std::vector<size_t>& visible) const
+{
+    visible.clear();
+    visible.insert(visible.end(), m_unboundedItems.begin(), m_unboundedItems.end());
+    if (m_nodes.empty())
+        return;
+    ClipBox clipBox(transState.translate(m_origin));
+    ClipBox::Classification leafClasses[leafSize];
+    uint32_t stack[64];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0)
+    {
+        const Node& node = m_nodes[stack[--stackSize]];
+        ClipBox::Classification cls = clipBox.classify(node.bbox);
+        if (cls == ClipBox::Outside)
+            continue;
+        if (cls == ClipBox::Inside)
+        {
+            for (uint32_t j = node.beginIndex; j < node.endIndex; ++j)
+                visible.push_back(m_items[j]);
+        }
+        else if (node.isLeaf)
+        {
+            uint32_t count = node.endIndex - node.beginIndex;
+            clipBox.classify(&m_itemBoxes[node.beginIndex], count, leafClasses);
+            for (uint32_t j = 0; j < count; ++j)
+            {
+                if (leafClasses[j] != ClipBox::Outside)
+                    visible.push_back(m_items[node.beginIndex + j]);
+            }
+        }
+        else
+        {
+            // Median splits keep the depth logarithmic, so the stack can't
+            // overflow for any realistic number of items.
+            uint32_t nodeIndex = (uint32_t)(&node - &m_nodes[0]);
+            stack[stackSize++] = node.secondChild;
+            stack[stackSize++] = nodeIndex + 1;
+        }
+    }
+    std::sort(visible.begin(), visible.end());
+}
@@ -0,0 +1,60 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "BvhNode.h"
+#include "util.h"
+
+struct TransformState;
+
+//------------------------------------------------------------------------------
+/// Bounding volume hierarchy over the bounding boxes of whole datasets
+///
+/// This allows the datasets visible in the view frustum to be found in time
+/// proportional to the number of visible datasets rather than the number
+/// loaded, so that off screen datasets cost nothing when drawing.
+///
+/// Items are identified by their index in the array of boxes passed to
+/// build().  Items with empty bounding boxes are never culled.
+class SceneBvh
+{
+    public:
+        /// Build the hierarchy over the given item bounding boxes
+        void build(const std::vector<Imath::Box3d>& boxes);
+
+        /// Remove all items
+        void clear();
+
+        /// Return number of items in the hierarchy
+        size_t size() const { return m_numItems; }
+
+        /// Find indices of items which may be visible from the view defined
+        /// by `transState`.  Indices are returned in increasing order.
+        void findVisible(const TransformState& transState,
+                         std::vector<size_t>& visible) const;
+
+    private:
+        /// Nodes index into m_items, with bounds relative to m_origin
+        typedef BvhNode Node;
+
+        uint32_t buildRecursive(const std::vector<Imath::Box3d>& boxes,
+                                const std::vector<V3d>& centers,
+                                uint32_t beginItem, uint32_t endItem);
+
+        /// Maximum number of items per leaf node
+        static const uint32_t leafSize = 4;
+
+        size_t m_numItems = 0;
+        /// Origin for node bounding boxes, for single precision culling
+        V3d m_origin = V3d(0);
+        std::vector<Node> m_nodes;
+        std::vector<uint32_t> m_items;
+        /// Bounds of each entry of m_items relative to m_origin
+        std::vector<Imath::Box3f> m_itemBoxes;
+        /// Items with empty bounding boxes
+        std::vector<uint32_t> m_unboundedItems;
+};
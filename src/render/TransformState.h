@@ -22,12 +22,37 @@ struct TransformState
         modelViewMatrix(modelViewMatrix)
     { }
 
+    bool operator==(const TransformState& rhs) const
+    {
+        return viewSize == rhs.viewSize && projMatrix == rhs.projMatrix &&
+               modelViewMatrix == rhs.modelViewMatrix;
+    }
+
     /// Return position of camera in model space
     V3d cameraPos() const
     {
         return V3d(0)*modelViewMatrix.inverse();
     }
 
+    /// Return true if the projection is orthographic, as from
+    /// setOrthoProjection(), rather than perspective
+    bool isOrthographic() const
+    {
+        return projMatrix[2][3] == 0;
+    }
+
+    /// Return the scale factor from the size of a small object to its size
+    /// on screen in pixels, at the center of the view.
+    ///
+    /// For a perspective projection this is the number of pixels per radian
+    /// of angular size, so object sizes must first be divided by their
+    /// distance from the camera.  For an orthographic projection it's the
+    /// number of pixels per unit length, independent of distance.
+    double pixelScale() const
+    {
+        return 0.5*viewSize.y*projMatrix[1][1];
+    }
+
     /// Translate model by given offset
     TransformState translate(const Imath::V3d& offset) const;
 
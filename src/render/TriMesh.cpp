@@ -3,9 +3,11 @@
 
 #include "TriMesh.h"
 
+#include <cfloat>
 #include <memory>
 
 #include <QDir>
+#include <QElapsedTimer>
 #include <QFileInfo>
 
 #include "glutil.h"
@@ -355,6 +357,14 @@ bool TriMesh::loadFile(QString fileName, size_t /*maxVertexCount*/)
     m_texcoords.swap(info.texcoords);
     m_triangles.swap(info.triangles);
     m_edges.swap(info.edges);
+    if (!m_triangles.empty())
+    {
+        QElapsedTimer bvhTimer;
+        bvhTimer.start();
+        m_triangleBvh.build((const V3f*)&m_verts[0], &m_triangles[0], m_triangles.size()/3);
+        g_logger.debug("Built picking hierarchy for %d triangles in %.2f seconds",
+                       m_triangles.size()/3, bvhTimer.elapsed()/1000.0);
+    }
     if (!info.textureFileName.isEmpty())
     {
         QImage image;
@@ -516,7 +526,8 @@ void TriMesh::drawEdges(QOpenGLShaderProgram& prog,
 
 void TriMesh::estimateCost(const TransformState& transState,
                            bool incrementalDraw, const double* qualities,
-                           DrawCount* drawCounts, int numEstimates) const
+                           DrawCount* drawCounts, int numEstimates,
+                           const OcclusionMap* occlusion) const
 {
     // FIXME - we need a way to incorporate meshes into the cost model, even
     // though simplifying them in a similar way to point clouds isn't really
@@ -528,13 +539,55 @@ bool TriMesh::pickVertex(const V3d& cameraPos,
                          const EllipticalDist& distFunc,
                          V3d& pickedVertex,
                          double* distance,
-                         std::string* info) const
+                         std::string* info,
+                         std::atomic<double>* distBound) const
 {
     if (m_verts.empty())
         return false;
 
-    size_t idx = distFunc.findNearest(offset(), (V3f*)&m_verts[0],
-                                      m_verts.size()/3, distance);
+    const V3f* P = (const V3f*)&m_verts[0];
+    double dist = DBL_MAX;
+    size_t idx = 0;
+    if (m_triangleBvh.empty())
+    {
+        // Edges only - fall back to searching all vertices
+        idx = distFunc.findNearest(offset(), P, m_verts.size()/3, &dist);
+    }
+    else
+    {
+        // Cast a ray through the pick position, and snap to the vertex of
+        // the first triangle hit which is nearest the hit point.  This avoids
+        // picking vertices hidden behind faces.
+        V3f rayOrigin = V3f(cameraPos - offset());
+        V3f rayDir = V3f(distFunc.axis());
+        size_t hitTri = 0;
+        float hitT = 0;
+        if (m_triangleBvh.intersectRay(P, &m_triangles[0], rayOrigin, rayDir, hitTri, hitT))
+        {
+            V3f hitPos = rayOrigin + hitT*rayDir;
+            const unsigned int* tri = &m_triangles[3*hitTri];
+            idx = tri[0];
+            for (int k = 1; k < 3; ++k)
+            {
+                if ((P[tri[k]] - hitPos).length2() < (P[idx] - hitPos).length2())
+                    idx = tri[k];
+            }
+            distFunc.findNearest(offset(), P + idx, 1, &dist);
+        }
+        else
+        {
+            // Nothing under the cursor, so snap to the nearest vertex
+            double maxDist = distBound ? distBound->load() : DBL_MAX;
+            idx = m_triangleBvh.findNearestVertex(distFunc, offset(), P, &m_triangles[0],
+                                                  maxDist, dist);
+            if (idx == size_t(-1))
+                return false;
+        }
+    }
+    if (distance)
+        *distance = dist;
+    if (distBound)
+        atomicMin(*distBound, dist);
 
     pickedVertex = V3d(m_verts[3*idx], m_verts[3*idx+1], m_verts[3*idx+2]) + offset();
 
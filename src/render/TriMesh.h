@@ -14,6 +14,7 @@
 #include <QOpenGLTexture>
 
 #include "Geometry.h"
+#include "TriangleBvh.h"
 
 class QOpenGLShaderProgram;
 
@@ -37,13 +38,15 @@ class TriMesh : public Geometry
 
         virtual void estimateCost(const TransformState& transState,
                                   bool incrementalDraw, const double* qualities,
-                                  DrawCount* drawCounts, int numEstimates) const;
+                                  DrawCount* drawCounts, int numEstimates,
+                                  const OcclusionMap* occlusion) const;
 
         virtual bool pickVertex(const V3d& cameraPos,
                                 const EllipticalDist& distFunc,
                                 V3d& pickedVertex,
                                 double* distance = 0,
-                                std::string* info = 0) const;
+                                std::string* info = 0,
+                                std::atomic<double>* distBound = 0) const;
 
     private:
         void initializeVertexGL(const char * vertArrayName, const std::vector<unsigned int>& elementInds,
@@ -70,6 +73,8 @@ class TriMesh : public Geometry
         /// triples of indices into vertex array
         std::vector<unsigned int> m_triangles;
         std::vector<unsigned int> m_edges;
+        /// Spatial hierarchy over m_triangles for picking
+        TriangleBvh m_triangleBvh;
 };
 
 
@@ -0,0 +1,310 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#include "TriangleBvh.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+
+/// Half the surface area of `box`, or zero for empty boxes
+static float halfArea(const Imath::Box3f& box)
+{
+    if (box.isEmpty())
+        return 0;
+    V3f s = box.size();
+    return s.x*s.y + s.y*s.z + s.z*s.x;
+}
+
+
+void TriangleBvh::clear()
+{
+    m_nodes.clear();
+    m_triInds.clear();
+}
+
+
+void TriangleBvh::build(const V3f* verts, const unsigned int* triangles,
+                        size_t numTriangles, unsigned int numThreads)
+{
+    clear();
+    if (numTriangles == 0)
+        return;
+    m_triInds.resize(numTriangles);
+    std::vector<BuildItem> items(numTriangles);
+    const size_t chunkSize = 65536;
+    parallelFor(0, (numTriangles + chunkSize - 1)/chunkSize, [&](size_t chunk)
+    {
+        size_t end = std::min(numTriangles, (chunk + 1)*chunkSize);
+        for (size_t i = chunk*chunkSize; i < end; ++i)
+        {
+            const unsigned int* tri = triangles + 3*i;
+            items[i].bbox.extendBy(verts[tri[0]]);
+            items[i].bbox.extendBy(verts[tri[1]]);
+            items[i].bbox.extendBy(verts[tri[2]]);
+            items[i].triangle = (uint32_t)i;
+        }
+    });
+    // Enough parallel levels to give each thread a subtree
+    if (numThreads == 0)
+        numThreads = ThreadPool::global().numThreads() + 1;
+    int parallelDepth = 0;
+    while ((1u << parallelDepth) < numThreads)
+        ++parallelDepth;
+    buildRecursive(items, 0, (uint32_t)numTriangles, parallelDepth, m_nodes);
+}
+
+
+/// Append the subtree for items[beginIndex:endIndex] to `nodes`.
+///
+/// The split position is chosen by binning the triangle centroids along the
+/// longest axis of their bounds, and evaluating the surface area heuristic
+/// between bins.  For the top `parallelDepth` levels the children are built
+/// as separate tasks on the shared thread pool (see parallelFor()), each into
+/// its own node array, and appended once both are complete.
+void TriangleBvh::buildRecursive(std::vector<BuildItem>& items,
+                                 uint32_t beginIndex, uint32_t endIndex,
+                                 int parallelDepth, std::vector<Node>& nodes)
+{
+    uint32_t nodeIndex = (uint32_t)nodes.size();
+    nodes.push_back(Node());
+    Node node;
+    // Triangle centroids are approximated by the center of their bounds.
+    // Doubled centers are used to save a multiplication.
+    Imath::Box3f centroidBox;
+    for (uint32_t j = beginIndex; j < endIndex; ++j)
+    {
+        node.bbox.extendBy(items[j].bbox);
+        centroidBox.extendBy(items[j].bbox.min + items[j].bbox.max);
+    }
+    node.beginIndex = beginIndex;
+    node.endIndex = endIndex;
+    node.secondChild = 0;
+    uint32_t count = endIndex - beginIndex;
+    node.isLeaf = count <= 2;
+    uint32_t midIndex = beginIndex + count/2;
+    int axis = centroidBox.majorAxis();
+    float extent = centroidBox.size()[axis];
+    if (!node.isLeaf && extent > 0)
+    {
+        Imath::Box3f binBoxes[numBins];
+        uint32_t binCounts[numBins] = {0};
+        float binScale = numBins/extent;
+        auto binIndex = [&](const BuildItem& item)
+        {
+            float c = item.bbox.min[axis] + item.bbox.max[axis];
+            return std::min((int)((c - centroidBox.min[axis])*binScale), numBins - 1);
+        };
+        for (uint32_t j = beginIndex; j < endIndex; ++j)
+        {
+            int b = binIndex(items[j]);
+            binBoxes[b].extendBy(items[j].bbox);
+            ++binCounts[b];
+        }
+        // Cost of splitting after bin i is accumulated in two sweeps
+        float splitCosts[numBins - 1];
+        Imath::Box3f sweepBox;
+        uint32_t sweepCount = 0;
+        for (int i = 0; i < numBins - 1; ++i)
+        {
+            sweepBox.extendBy(binBoxes[i]);
+            sweepCount += binCounts[i];
+            splitCosts[i] = halfArea(sweepBox)*sweepCount;
+        }
+        sweepBox.makeEmpty();
+        sweepCount = 0;
+        for (int i = numBins - 1; i > 0; --i)
+        {
+            sweepBox.extendBy(binBoxes[i]);
+            sweepCount += binCounts[i];
+            splitCosts[i - 1] += halfArea(sweepBox)*sweepCount;
+        }
+        int bestSplit = 0;
+        for (int i = 1; i < numBins - 1; ++i)
+        {
+            if (splitCosts[i] < splitCosts[bestSplit])
+                bestSplit = i;
+        }
+        // Traversing a node costs about as much as intersecting a triangle
+        float nodeArea = halfArea(node.bbox);
+        float splitCost = 1 + ((nodeArea > 0) ? splitCosts[bestSplit]/nodeArea : count);
+        if (count <= maxLeafSize && splitCost >= count)
+            node.isLeaf = true;
+        else
+        {
+            auto mid = std::partition(items.begin() + beginIndex, items.begin() + endIndex,
+                                      [&](const BuildItem& item) { return binIndex(item) <= bestSplit; });
+            midIndex = (uint32_t)(mid - items.begin());
+        }
+    }
+    else if (count <= maxLeafSize)
+        node.isLeaf = true;
+    // Coincident centroids or a degenerate binning fall back to splitting
+    // the triangles in half
+    if (!node.isLeaf && (midIndex == beginIndex || midIndex == endIndex))
+        midIndex = beginIndex + count/2;
+    if (node.isLeaf)
+    {
+        for (uint32_t j = beginIndex; j < endIndex; ++j)
+            m_triInds[j] = items[j].triangle;
+    }
+    else
+    {
+        const uint32_t minParallelCount = 10000;
+        if (parallelDepth > 0 && count >= minParallelCount)
+        {
+            std::vector<Node> childNodes[2];
+            uint32_t childRanges[3] = {beginIndex, midIndex, endIndex};
+            parallelFor(0, 2, [&](size_t i)
+            {
+                buildRecursive(items, childRanges[i], childRanges[i+1],
+                               parallelDepth - 1, childNodes[i]);
+            });
+            for (int i = 0; i < 2; ++i)
+            {
+                uint32_t childOffset = (uint32_t)nodes.size();
+                if (i == 1)
+                    node.secondChild = childOffset;
+                for (Node& n : childNodes[i])
+                {
+                    if (!n.isLeaf)
+                        n.secondChild += childOffset;
+                    nodes.push_back(n);
+                }
+            }
+        }
+        else
+        {
+            buildRecursive(items, beginIndex, midIndex, parallelDepth, nodes);
+            node.secondChild = (uint32_t)nodes.size();
+            buildRecursive(items, midIndex, endIndex, parallelDepth, nodes);
+        }
+    }
+    nodes[nodeIndex] = node;
+}
+
+
+/// Return the ray parameter at which the ray enters `box`, or FLT_MAX if it
+/// misses the box or enters beyond `tmax`
+static float rayEnterBox(const Imath::Box3f& box, const V3f& origin,
+                         const V3f& invDir, float tmax)
+{
+    float t0 = 0;
+    float t1 = tmax;
+    for (int a = 0; a < 3; ++a)
+    {
+        float tnear = (box.min[a] - origin[a])*invDir[a];
+        float tfar  = (box.max[a] - origin[a])*invDir[a];
+        if (tnear > tfar)
+            std::swap(tnear, tfar);
+        // Written so that NaNs from rays in the plane of a face don't cull
+        t0 = (tnear > t0) ? tnear : t0;
+        t1 = (tfar < t1) ? tfar : t1;
+    }
+    return (t0 <= t1) ? t0 : FLT_MAX;
+}
+
+
+/// Moller-Trumbore ray triangle intersection.  Return the ray parameter of
+/// the hit from either side, or FLT_MAX if there's no hit.
+static float rayHitTriangle(const V3f& p0, const V3f& p1, const V3f& p2,
+                            const V3f& origin, const V3f& dir)
+{
+    V3f e1 = p1 - p0;
+    V3f e2 = p2 - p0;
+    V3f q = dir.cross(e2);
+    float det = e1.dot(q);
+    if (det == 0)
+        return FLT_MAX;
+    float invDet = 1/det;
+    V3f s = origin - p0;
+    float u = s.dot(q)*invDet;
+    if (u < 0 || u > 1)
+        return FLT_MAX;
+    V3f r = s.cross(e1);
+    float v = dir.dot(r)*invDet;
+    if (v < 0 || u + v > 1)
+        return FLT_MAX;
+    float t = e2.dot(r)*invDet;
+    return (t > 0) ? t : FLT_MAX;
+}
+
+
+bool TriangleBvh::intersectRay(const V3f* verts, const unsigned int* triangles,
+                               const V3f& origin, const V3f& dir,
+                               size_t& triangle, float& t) const
+{
+    if (m_nodes.empty())
+        return false;
+    V3f invDir(1/dir.x, 1/dir.y, 1/dir.z);
+    float closestT = FLT_MAX;
+    // Depth first traversal, visiting the nearer child first so that most
+    // far nodes are culled by the closest hit so far.
+    std::vector<uint32_t> stack;
+    stack.push_back(0);
+    while (!stack.empty())
+    {
+        uint32_t nodeIndex = stack.back();
+        stack.pop_back();
+        const Node& node = m_nodes[nodeIndex];
+        if (rayEnterBox(node.bbox, origin, invDir, closestT) == FLT_MAX)
+            continue;
+        if (node.isLeaf)
+        {
+            for (uint32_t j = node.beginIndex; j < node.endIndex; ++j)
+            {
+                const unsigned int* tri = triangles + 3*m_triInds[j];
+                float tHit = rayHitTriangle(verts[tri[0]], verts[tri[1]], verts[tri[2]],
+                                            origin, dir);
+                if (tHit < closestT)
+                {
+                    closestT = tHit;
+                    triangle = m_triInds[j];
+                }
+            }
+            continue;
+        }
+        uint32_t first = nodeIndex + 1;
+        uint32_t second = node.secondChild;
+        float tFirst = rayEnterBox(m_nodes[first].bbox, origin, invDir, closestT);
+        float tSecond = rayEnterBox(m_nodes[second].bbox, origin, invDir, closestT);
+        if (tSecond < tFirst)
+        {
+            std::swap(first, second);
+            std::swap(tFirst, tSecond);
+        }
+        if (tSecond != FLT_MAX)
+            stack.push_back(second);
+        if (tFirst != FLT_MAX)
+            stack.push_back(first);
+    }
+    if (closestT == FLT_MAX)
+        return false;
+    t = closestT;
+    return true;
+}
+
+
+size_t TriangleBvh::findNearestVertex(const EllipticalDist& distFunc, const V3d& offset,
+                                      const V3f* verts, const unsigned int* triangles,
+                                      double maxDist, double& dist) const
+{
+    V3f leafVerts[3*maxLeafSize];
+    return findNearestInBvh(m_nodes, distFunc, offset, maxDist, dist,
+        [&](const Node& node, double& leafDist)
+        {
+            uint32_t count = 0;
+            for (uint32_t j = node.beginIndex; j < node.endIndex; ++j)
+            {
+                const unsigned int* tri = triangles + 3*m_triInds[j];
+                for (int k = 0; k < 3; ++k)
+                    leafVerts[count++] = verts[tri[k]];
+            }
+            size_t j = distFunc.findNearest(offset, leafVerts, count, &leafDist);
+            if (j >= count)
+                return size_t(-1);
+            return (size_t)triangles[3*m_triInds[node.beginIndex + j/3] + j % 3];
+        }
+    );
+}
@@ -0,0 +1,75 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "BvhNode.h"
+#include "util.h"
+
+//------------------------------------------------------------------------------
+/// Bounding volume hierarchy over the triangles of a mesh, for picking
+///
+/// The hierarchy is built with the surface area heuristic, evaluated over a
+/// fixed number of bins per node.  Large subtrees are built in parallel.
+///
+/// The vertex and triangle arrays aren't owned; the same arrays must be
+/// passed to the query functions as to build().  Triangles are identified by
+/// their index in the triangle array, which holds vertex index triples.
+class TriangleBvh
+{
+    public:
+        /// Build the hierarchy over `numTriangles` triangles, split into
+        /// subtrees for `numThreads` threads of the shared thread pool, or
+        /// for the whole pool if zero.
+        void build(const V3f* verts, const unsigned int* triangles,
+                   size_t numTriangles, unsigned int numThreads = 0);
+
+        /// Remove all triangles
+        void clear();
+
+        bool empty() const { return m_nodes.empty(); }
+
+        /// Find the first triangle hit by the ray `origin + t*dir` for t > 0
+        ///
+        /// Return true if there is a hit, along with the triangle index and
+        /// ray parameter `t` of the hit point.
+        bool intersectRay(const V3f* verts, const unsigned int* triangles,
+                          const V3f& origin, const V3f& dir,
+                          size_t& triangle, float& t) const;
+
+        /// Return index of the triangle vertex nearest to the origin of
+        /// `distFunc`, where the true vertex positions are `verts[i] + offset`
+        ///
+        /// Only vertices closer than `maxDist` are considered.  If there are
+        /// none, return size_t(-1) and set `dist` to DBL_MAX.
+        size_t findNearestVertex(const EllipticalDist& distFunc, const V3d& offset,
+                                 const V3f* verts, const unsigned int* triangles,
+                                 double maxDist, double& dist) const;
+
+    private:
+        /// Nodes index into m_triInds
+        typedef BvhNode Node;
+
+        /// Triangle bounds, partitioned in place while building so that
+        /// memory is accessed sequentially
+        struct BuildItem
+        {
+            Imath::Box3f bbox;
+            uint32_t triangle;
+        };
+
+        void buildRecursive(std::vector<BuildItem>& items,
+                            uint32_t beginIndex, uint32_t endIndex,
+                            int parallelDepth, std::vector<Node>& nodes);
+
+        /// Maximum number of triangles per leaf
+        static const uint32_t maxLeafSize = 8;
+        /// Number of bins for evaluating split costs
+        static const int numBins = 16;
+
+        std::vector<Node> m_nodes;
+        std::vector<uint32_t> m_triInds;
+};
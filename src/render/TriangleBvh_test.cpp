@@ -0,0 +1,170 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#include <catch.hpp>
+
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+#include "TriangleBvh.h"
+
+// gcc 4.6 and 4.7 warns/suggests parentheses around == comparison
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wparentheses"
+#endif
+
+static double randUniform(double a, double b)
+{
+    return a + (b - a)*rand()/double(RAND_MAX);
+}
+
+
+/// Brute force ray triangle intersection, returning FLT_MAX for a miss
+static float bruteForceRayHit(const std::vector<V3f>& verts,
+                              const std::vector<unsigned int>& triangles,
+                              const V3f& origin, const V3f& dir)
+{
+    float closestT = FLT_MAX;
+    for (size_t i = 0; i < triangles.size(); i += 3)
+    {
+        const V3f& p0 = verts[triangles[i]];
+        V3f e1 = verts[triangles[i+1]] - p0;
+        V3f e2 = verts[triangles[i+2]] - p0;
+        V3f q = dir.cross(e2);
+        float det = e1.dot(q);
+        if (det == 0)
+            continue;
+        V3f s = origin - p0;
+        float u = s.dot(q)/det;
+        V3f r = s.cross(e1);
+        float v = dir.dot(r)/det;
+        float t = e2.dot(r)/det;
+        if (u >= 0 && v >= 0 && u + v <= 1 && t > 0 && t < closestT)
+            closestT = t;
+    }
+    return closestT;
+}
+
+
+/// Bumpy terrain mesh over a regular grid, with two triangles per cell
+static void makeTerrain(int n, std::vector<V3f>& verts,
+                        std::vector<unsigned int>& triangles)
+{
+    for (int j = 0; j <= n; ++j)
+    for (int i = 0; i <= n; ++i)
+        verts.push_back(V3f(i, j, 5*sin(0.1f*i)*cos(0.13f*j) + 0.2f*randUniform(0, 1)));
+    for (int j = 0; j < n; ++j)
+    for (int i = 0; i < n; ++i)
+    {
+        unsigned int v = j*(n + 1) + i;
+        unsigned int cell[] = {v, v + 1, v + n + 2,  v, v + n + 2, v + n + 1};
+        triangles.insert(triangles.end(), cell, cell + 6);
+    }
+}
+
+
+TEST_CASE("TriangleBvh agrees with brute force queries")
+{
+    // Large enough that the top levels are built in parallel
+    const int n = 80;
+    std::vector<V3f> verts;
+    std::vector<unsigned int> triangles;
+    makeTerrain(n, verts, triangles);
+    size_t numTriangles = triangles.size()/3;
+    REQUIRE(numTriangles > 10000);
+
+    TriangleBvh bvh;
+    bvh.build(verts.data(), triangles.data(), numTriangles, 4);
+    REQUIRE(!bvh.empty());
+
+    SECTION("Ray intersection")
+    {
+        int numHits = 0;
+        for (int i = 0; i < 500; ++i)
+        {
+            V3f origin(randUniform(-10, n + 10), randUniform(-10, n + 10), randUniform(10, 50));
+            V3f target(randUniform(0, n), randUniform(0, n), randUniform(-5, 5));
+            V3f dir = (target - origin).normalized();
+            float expectedT = bruteForceRayHit(verts, triangles, origin, dir);
+            size_t triangle = -1;
+            float t = 0;
+            bool hit = bvh.intersectRay(verts.data(), triangles.data(),
+                                        origin, dir, triangle, t);
+            REQUIRE(hit == (expectedT != FLT_MAX));
+            if (hit)
+            {
+                ++numHits;
+                REQUIRE(triangle < numTriangles);
+                CHECK(t == Approx(expectedT));
+            }
+        }
+        CHECK(numHits > 0);
+        // Rays pointing away from the mesh
+        size_t triangle = 0;
+        float t = 0;
+        CHECK(!bvh.intersectRay(verts.data(), triangles.data(), V3f(n/2, n/2, 20),
+                                V3f(0, 0, 1), triangle, t));
+    }
+
+    SECTION("Nearest vertex")
+    {
+        const V3d offset(1000, 2000, 0);
+        for (int i = 0; i < 100; ++i)
+        {
+            V3d origin = offset + V3d(randUniform(-10, n + 10), randUniform(-10, n + 10),
+                                      randUniform(-10, 50));
+            V3d axis(randUniform(-1, 1), randUniform(-1, 1), randUniform(-1, 1));
+            EllipticalDist distFunc(origin, axis, (i % 2 == 0) ? 0.01 : 1.0);
+
+            double bruteDist = 0;
+            distFunc.findNearest(offset, verts.data(), verts.size(), &bruteDist);
+
+            double dist = 0;
+            size_t idx = bvh.findNearestVertex(distFunc, offset, verts.data(),
+                                               triangles.data(), DBL_MAX, dist);
+            REQUIRE(idx < verts.size());
+            CHECK(dist == Approx(bruteDist));
+            double vertDist = 0;
+            distFunc.findNearest(offset, &verts[idx], 1, &vertDist);
+            CHECK(vertDist == Approx(dist));
+
+            idx = bvh.findNearestVertex(distFunc, offset, verts.data(), triangles.data(),
+                                        1.01*bruteDist, dist);
+            CHECK(idx < verts.size());
+            CHECK(dist == Approx(bruteDist));
+
+            idx = bvh.findNearestVertex(distFunc, offset, verts.data(), triangles.data(),
+                                        0.99*bruteDist, dist);
+            CHECK(idx == size_t(-1));
+            CHECK(dist == DBL_MAX);
+        }
+    }
+}
+
+
+TEST_CASE("TriangleBvh built serially matches parallel build")
+{
+    const int n = 80;
+    std::vector<V3f> verts;
+    std::vector<unsigned int> triangles;
+    makeTerrain(n, verts, triangles);
+    size_t numTriangles = triangles.size()/3;
+    TriangleBvh serialBvh;
+    serialBvh.build(verts.data(), triangles.data(), numTriangles, 1);
+    TriangleBvh parallelBvh;
+    parallelBvh.build(verts.data(), triangles.data(), numTriangles, 8);
+    for (int i = 0; i < 200; ++i)
+    {
+        V3f origin(randUniform(0, n), randUniform(0, n), 30);
+        V3f dir = V3f(randUniform(-0.3, 0.3), randUniform(-0.3, 0.3), -1).normalized();
+        size_t tri1 = -1, tri2 = -1;
+        float t1 = 0, t2 = 0;
+        bool hit1 = serialBvh.intersectRay(verts.data(), triangles.data(), origin, dir, tri1, t1);
+        bool hit2 = parallelBvh.intersectRay(verts.data(), triangles.data(), origin, dir, tri2, t2);
+        REQUIRE(hit1 == hit2);
+        if (hit1)
+            CHECK(t1 == t2);
+    }
+}
@@ -9,6 +9,8 @@
 
 #include "View3D.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cfloat>
 
 #include <QTimer>
@@ -62,8 +64,8 @@ View3D::View3D(GeometryCollection* geometries, const QGLFormat& format, MainWind
     setSizePolicy(QSizePolicy::Ignored, QSizePolicy::Ignored);
     setFocus();
 
-    connect(&m_camera, SIGNAL(projectionChanged()), this, SLOT(restartRender()));
-    connect(&m_camera, SIGNAL(viewChanged()), this, SLOT(restartRender()));
+    connect(&m_camera, SIGNAL(projectionChanged()), this, SLOT(cameraChanged()));
+    connect(&m_camera, SIGNAL(viewChanged()), this, SLOT(cameraChanged()));
 
     makeCurrent();
     m_shaderProgram = std::make_unique<ShaderProgram>();
@@ -105,19 +107,77 @@ View3D::View3D(GeometryCollection* geometries, const QGLFormat& format, MainWind
     m_annotationAction->setCheckable(true);
     m_annotationAction->setChecked(m_drawAnnotations);
     connect(m_annotationAction, SIGNAL(toggled(bool)), this, SLOT(setAnnotations(bool)));
+
+    m_fillHolesAction = new QAction(tr("&Fill Holes Between Points"), this);
+    m_fillHolesAction->setCheckable(true);
+    m_fillHolesAction->setChecked(m_fillHoles);
+    connect(m_fillHolesAction, SIGNAL(toggled(bool)), this, SLOT(setFillHoles(bool)));
+
+    m_cacheLayersAction = new QAction(tr("Cache &Layers Per Dataset"), this);
+    m_cacheLayersAction->setCheckable(true);
+    m_cacheLayersAction->setChecked(m_cacheLayers);
+    connect(m_cacheLayersAction, SIGNAL(toggled(bool)), this, SLOT(setCacheLayers(bool)));
+
+    m_occlusionCullingAction = new QAction(tr("&Occlusion Culling"), this);
+    m_occlusionCullingAction->setCheckable(true);
+    m_occlusionCullingAction->setChecked(m_occlusionCulling);
+    connect(m_occlusionCullingAction, SIGNAL(toggled(bool)), this, SLOT(setOcclusionCulling(bool)));
 }
 
 void View3D::restartRender()
 {
     m_incrementalDraw = false;
+    // The scene itself changed, so the previous frame can't be reused
+    m_prevFrameValid = false;
+    m_invalidateLayers = true;
+    // Depth from the old scene can't be used to cull the new one
+    m_occlusionMap.clear();
+    m_occlusionReadStale = m_occlusionReadFence != 0;
+    update();
+}
+
+void View3D::cameraChanged()
+{
+    // Restart drawing, but keep the previous frame for reprojection
+    m_incrementalDraw = false;
+    m_cameraStillTimer.start();
+    m_invalidateLayers = true;
+    update();
+}
+
+void View3D::selectionChanged()
+{
+    m_selectionCacheValid = false;
+    if (!m_cacheLayers)
+    {
+        restartRender();
+        return;
+    }
+    // Cached layers of the remaining geometries are still valid; they just
+    // need to be composited again.
+    m_incrementalDraw = false;
+    m_prevFrameValid = false;
     update();
 }
 
 void View3D::geometryChanged()
 {
+    m_selectionCacheValid = false;
     restartRender();
 }
 
+void View3D::geometryDataAvailable()
+{
+    // More of a streamed geometry has loaded in the background.  The rest of
+    // the scene is unchanged, so unlike restartRender() the occlusion map,
+    // previous frame and other geometries' layers are kept.
+    auto layer = m_layers.find(qobject_cast<const Geometry*>(sender()));
+    if (layer != m_layers.end())
+        layer->second->valid = false;
+    m_incrementalDraw = false;
+    update();
+}
+
 /// Initialize all geometry in m_geometries for indices i in [begin,end)
 void View3D::initializeGLGeometry(int begin, int end)
 {
@@ -133,6 +193,8 @@ void View3D::initializeGLGeometry(int begin, int end)
             geoms[i]->setShaderId("annotation", m_annotationShader->shaderProgram().programId());
             geoms[i]->initializeGL();
         }
+        connect(geoms[i].get(), SIGNAL(dataAvailable()),
+                this, SLOT(geometryDataAvailable()), Qt::UniqueConnection);
     }
 }
 
@@ -183,11 +245,12 @@ void View3D::setSelectionModel(QItemSelectionModel* selectionModel)
     if (m_selectionModel)
     {
         disconnect(m_selectionModel, SIGNAL(selectionChanged(QItemSelection,QItemSelection)),
-                   this, SLOT(restartRender()));
+                   this, SLOT(selectionChanged()));
     }
     m_selectionModel = selectionModel;
+    m_selectionCacheValid = false;
     connect(m_selectionModel, SIGNAL(selectionChanged(QItemSelection,QItemSelection)),
-            this, SLOT(restartRender()));
+            this, SLOT(selectionChanged()));
 }
 
 
@@ -251,6 +314,26 @@ void View3D::setAnnotations(bool enable)
     restartRender();
 }
 
+void View3D::setCacheLayers(bool enable)
+{
+    m_cacheLayers = enable;
+    restartRender();
+}
+
+void View3D::setOcclusionCulling(bool enable)
+{
+    m_occlusionCulling = enable;
+    restartRender();
+}
+
+void View3D::setFillHoles(bool enable)
+{
+    // Hole filling only affects display of the accumulated frame, so there's
+    // no need to restart drawing.
+    m_fillHoles = enable;
+    update();
+}
+
 void View3D::centerOnGeometry(const QModelIndex& index)
 {
     const Geometry& geom = *m_geometries->get()[index.row()];
@@ -313,6 +396,9 @@ void View3D::initializeGL()
     // GL_CHECK has to be defined for this to actually do something
     glCheckError();
 
+    if (!m_frameTimerQueries.init())
+        g_logger.info("%s", "GPU timer queries unavailable; using glFinish() to measure frame time");
+
     initCursor(10, 1);
     initAxes();
     initGrid(2.0f);
@@ -336,6 +422,19 @@ void View3D::initializeGL()
     int h = height() * dPR;
 
     m_incrementalFramebuffer.init(w, h);
+    m_prevFramebuffer.init(w, h);
+    m_prevFrameValid = false;
+
+    m_reprojectShader.reset(new ShaderProgram());
+    m_reprojectShader->setShaderFromSourceFile("shaders:reproject.glsl");
+    m_holeFillShader.reset(new ShaderProgram());
+    m_holeFillShader->setShaderFromSourceFile("shaders:hole_fill.glsl");
+    m_layerCompositeShader.reset(new ShaderProgram());
+    m_layerCompositeShader->setShaderFromSourceFile("shaders:layer_composite.glsl");
+    m_depthDownsampleShader.reset(new ShaderProgram());
+    m_depthDownsampleShader->setShaderFromSourceFile("shaders:depth_downsample.glsl");
+    glGenBuffers(1, &m_occlusionPixelBuffer);
+    glGenVertexArrays(1, &m_emptyVertexArray);
 
     initializeGLGeometry(0, m_geometries->get().size());
 
@@ -369,6 +468,14 @@ void View3D::resizeGL(int w, int h)
     m_camera.setViewport(QRect(0,0,double(w)/dPR,double(h)/dPR));
 
     m_incrementalFramebuffer.init(w,h);
+    m_prevFramebuffer.init(w,h);
+    m_prevFrameValid = false;
+    m_layers.clear();
+    m_occlusionReadSize = Imath::V2i((w + occlusionBlockSize - 1)/occlusionBlockSize,
+                                     (h + occlusionBlockSize - 1)/occlusionBlockSize);
+    m_occlusionFramebuffer.init(m_occlusionReadSize.x, m_occlusionReadSize.y);
+    m_occlusionMap.clear();
+    m_occlusionReadStale = m_occlusionReadFence != 0;
     glCheckError();
 }
 
@@ -398,37 +505,108 @@ void View3D::paintGL()
 
     glCheckError();
 
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_incrementalFramebuffer.id());
-
-    //--------------------------------------------------
-    // Draw main scene
     TransformState transState(Imath::V2i(w, h),
                               m_camera.projectionMatrix(),
                               m_camera.viewMatrix());
 
+    // Only geometry which may be visible is considered any further
+    std::vector<const Geometry*> geoms;
+    std::vector<int> fileNumbers;
+    visibleGeometry(transState, geoms, fileNumbers);
+
+    // Render each geometry into a separate cached layer if enabled and all
+    // the selected layers fit into the memory limit.
+    const size_t layerBytes = size_t(w)*h*8;
+    const size_t maxLayers = m_layerCacheMaxBytes/layerBytes;
+    bool useLayers = m_cacheLayers && geoms.size() <= maxLayers;
+    if (!useLayers && !m_layers.empty())
+    {
+        m_layers.clear();
+        // Drawing state of the geometries belonged to the layers
+        m_incrementalDraw = false;
+    }
+
+    // Reprojected pixels only stand in for the real frame while the camera
+    // moves: they blur and drift further with each reprojection, and
+    // incremental drawing only adds to them.  Once the camera has been still
+    // for a moment, start again from a clean frame.
+    const int cleanRestartDelay = 100;
+    if (m_incrementalDraw && m_frameReprojected &&
+        (!m_cameraStillTimer.isValid() || m_cameraStillTimer.elapsed() >= cleanRestartDelay))
+    {
+        m_incrementalDraw = false;
+        m_prevFrameValid = false;
+    }
+
+    // Keep the previously accumulated frame when restarting, so that it can
+    // be reprojected into the new view.  (With layers, the accumulated frame
+    // is rebuilt by compositing every frame instead.)
+    bool reprojectFrame = false;
+    if (!m_incrementalDraw && !useLayers)
+    {
+        reprojectFrame = m_prevFrameValid;
+        m_frameReprojected = reprojectFrame;
+        m_incrementalFramebuffer.swap(m_prevFramebuffer);
+    }
+    if (useLayers)
+        m_frameReprojected = false;
+
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_incrementalFramebuffer.id());
+
+    //--------------------------------------------------
+    // Draw main scene
     glClearDepth(1.0f);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     glDepthFunc(GL_LEQUAL);
     glClearColor(m_backgroundColor.redF(), m_backgroundColor.greenF(),
                  m_backgroundColor.blueF(), 1.0f);
     glClearStencil(0);
-    if (!m_incrementalDraw)
+    if (!m_incrementalDraw || useLayers)
     {
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
     }
 
-    std::vector<const Geometry*> geoms = selectedGeometry();
+    // Cull points against the depth of a recent frame.  Layers are drawn
+    // independently of each other, so can't be culled this way.
+    const OcclusionMap* occlusion = nullptr;
+    if (m_occlusionCulling && !useLayers)
+    {
+        readOcclusionMap();
+        if (m_occlusionMap.isValid())
+            occlusion = &m_occlusionMap;
+    }
 
     // Aim for 40ms frame time - an ok tradeoff for desktop usage
     const double targetMillisecs = 40;
+    std::vector<double> geomQualities;
     double quality = m_drawCostModel.quality(targetMillisecs, geoms, transState,
-                                             m_incrementalDraw);
+                                             m_incrementalDraw, occlusion,
+                                             geomQualities);
+
+    // Time the geometry on the GPU if possible.  If all timer queries are
+    // still in flight this frame just isn't measured.
+    bool gpuTimed = !geoms.empty() && m_frameTimerQueries.begin();
 
-    // Render points
-    DrawCount drawCount = drawPoints(transState, geoms, quality, m_incrementalDraw);
+    // Seed the frame with the previous image; points drawn below fill the
+    // holes and refresh it.
+    if (reprojectFrame)
+        reprojectPreviousFrame(transState);
+
+    DrawCount drawCount;
+    if (useLayers)
+    {
+        drawCount = drawLayers(transState, geoms, fileNumbers, geomQualities);
+        evictLayers(maxLayers);
+    }
+    else
+    {
+        // Render points
+        drawCount = drawPoints(transState, geoms, fileNumbers, geomQualities,
+                               m_incrementalDraw, occlusion);
+    }
 
     // Draw meshes and lines
-    if (!m_incrementalDraw)
+    if (!m_incrementalDraw && !useLayers)
     {
         drawMeshes(transState, geoms);
         // Generic draw for any other geometry
@@ -439,16 +617,36 @@ void View3D::paintGL()
             geoms[i]->draw(transState, quality);
     }
 
+    if (m_occlusionCulling && !useLayers)
+        requestOcclusionMap(transState);
+
+    // Display the accumulated frame.  This is included in the frame time
+    // so that the cost of hole filling is accounted for.
+    displayFrame(transState, w, h);
+
     // Measure frame time to update estimate for how much geometry we can draw
-    // with a reasonable frame rate
-    glFinish();
-    int frameTime = frameTimer.elapsed();
+    // with a reasonable frame rate.  GPU timings are collected a few frames
+    // later; the frame time is the larger of the GPU time and the time taken
+    // to submit the commands, which accounts for CPU bound data uploads.
+    if (m_frameTimerQueries.isValid())
+    {
+        if (gpuTimed)
+            m_frameTimerQueries.end(std::make_pair(drawCount, double(frameTimer.elapsed())));
+        double gpuTime = 0;
+        std::pair<DrawCount,double> timedFrame;
+        while (m_frameTimerQueries.poll(gpuTime, timedFrame))
+            m_drawCostModel.addSample(timedFrame.first, std::max(gpuTime, timedFrame.second));
+    }
+    else
+    {
+        glFinish();
+        int frameTime = frameTimer.elapsed();
+        if (!geoms.empty())
+            m_drawCostModel.addSample(drawCount, frameTime);
+    }
 
     glCheckError();
 
-    if (!geoms.empty())
-        m_drawCostModel.addSample(drawCount, frameTime);
-
     // Debug: print bar showing how well we're sticking to the frame time
 //    int barSize = 40;
 //    std::string s = std::string(barSize*frameTime/targetMillisecs, '=');
@@ -456,14 +654,6 @@ void View3D::paintGL()
 //        s[barSize] = '|';
 //    tfm::printfln("%12f %4d %s", quality, frameTime, s);
 
-    // TODO: this should really render a texture onto a quad and not use glBlitFramebuffer
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
-    glBindFramebuffer(GL_READ_FRAMEBUFFER, m_incrementalFramebuffer.id());
-    glBlitFramebuffer(0,0,w,h, 0,0,w,h,
-                      GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT, GL_NEAREST); // has to be GL_NEAREST to work with DEPTH
-
-    glCheckError();
-
     // Draw a grid for orientation purposes
     if (m_drawGrid)
     {
@@ -508,13 +698,300 @@ void View3D::paintGL()
         drawAnnotations(transState, w, h);
     }
 
-    // Set up timer to draw a high quality frame if necessary
-    if (!drawCount.moreToDraw)
+    // Set up timer to draw a high quality frame if necessary, or to replace
+    // a reprojected frame once the camera stops
+    if (!drawCount.moreToDraw && !m_frameReprojected)
         m_incrementalFrameTimer->stop();
     else
         m_incrementalFrameTimer->start(10);
 
     m_incrementalDraw = true;
+    m_prevViewProjMatrix = transState.modelViewMatrix * transState.projMatrix;
+    m_prevFrameValid = true;
+}
+
+
+/// Draw each geometry into its own cached layer, and composite the layers
+/// into the currently bound framebuffer.
+///
+/// Layers persist while the camera and scene are unchanged, so that adding a
+/// geometry to the selection only requires drawing that geometry, and
+/// removing one requires no drawing at all.  Each layer is drawn
+/// incrementally until complete.
+DrawCount View3D::drawLayers(const TransformState& transState,
+                             const std::vector<const Geometry*>& geoms,
+                             const std::vector<int>& fileNumbers,
+                             const std::vector<double>& qualities)
+{
+    ++m_frameNumber;
+    if (m_invalidateLayers)
+    {
+        for (auto& layer : m_layers)
+            layer.second->valid = false;
+        m_invalidateLayers = false;
+    }
+
+    GLint compositeFramebuffer = 0;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &compositeFramebuffer);
+    DrawCount totDrawCount;
+    for (size_t i = 0; i < geoms.size(); ++i)
+    {
+        const Geometry* geom = geoms[i];
+        std::unique_ptr<GeometryLayer>& layer = m_layers[geom];
+        if (!layer)
+        {
+            layer.reset(new GeometryLayer());
+            layer->framebuffer.init(transState.viewSize.x, transState.viewSize.y);
+        }
+        layer->lastUsedFrame = m_frameNumber;
+        bool incrementalDraw = layer->valid;
+        if (incrementalDraw && !layer->moreToDraw)
+            continue;
+
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, layer->framebuffer.id());
+        if (!incrementalDraw)
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+        std::vector<const Geometry*> layerGeoms(1, geom);
+        DrawCount drawCount = drawPoints(transState, layerGeoms,
+                                         std::vector<int>(1, fileNumbers[i]),
+                                         std::vector<double>(1, qualities[i]),
+                                         incrementalDraw, nullptr);
+        if (!incrementalDraw)
+        {
+            drawMeshes(transState, layerGeoms);
+            geom->draw(transState, 1);
+        }
+        layer->valid = true;
+        layer->moreToDraw = drawCount.moreToDraw;
+        totDrawCount += drawCount;
+    }
+
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, compositeFramebuffer);
+    for (size_t i = 0; i < geoms.size(); ++i)
+        compositeLayer(m_layers[geoms[i]]->framebuffer);
+    return totDrawCount;
+}
+
+
+/// Free least recently used layers of geometries which aren't currently
+/// drawn, until at most `maxLayers` remain.
+void View3D::evictLayers(size_t maxLayers)
+{
+    while (m_layers.size() > maxLayers)
+    {
+        auto lru = std::min_element(m_layers.begin(), m_layers.end(),
+            [](const auto& a, const auto& b)
+            { return a.second->lastUsedFrame < b.second->lastUsedFrame; });
+        if (lru->second->lastUsedFrame == m_frameNumber)
+            break;
+        m_layers.erase(lru);
+    }
+}
+
+
+/// Merge `layer` into the currently bound framebuffer by depth
+void View3D::compositeLayer(const Framebuffer& layer)
+{
+    if (!m_layerCompositeShader || !m_layerCompositeShader->isValid())
+        return;
+    QOpenGLShaderProgram& prog = m_layerCompositeShader->shaderProgram();
+    prog.bind();
+    prog.setUniformValue("colorTex", 0);
+    prog.setUniformValue("depthTex", 1);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, layer.colorTexture());
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, layer.depthTexture());
+
+    glDisable(GL_BLEND);
+    glDisable(GL_STENCIL_TEST);
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LESS);
+
+    glBindVertexArray(m_emptyVertexArray);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindVertexArray(0);
+
+    glDepthFunc(GL_LEQUAL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    prog.release();
+    glCheckError();
+}
+
+
+/// Collect the depth read back by requestOcclusionMap() into the occlusion
+/// map, if it has arrived.
+void View3D::readOcclusionMap()
+{
+    if (!m_occlusionReadFence)
+        return;
+    if (glClientWaitSync(m_occlusionReadFence, 0, 0) == GL_TIMEOUT_EXPIRED)
+        return;
+    glDeleteSync(m_occlusionReadFence);
+    m_occlusionReadFence = 0;
+    if (m_occlusionReadStale)
+    {
+        m_occlusionReadStale = false;
+        return;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, m_occlusionPixelBuffer);
+    GLsizeiptr size = sizeof(float)*m_occlusionReadSize.x*m_occlusionReadSize.y;
+    const float* depth = (const float*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size,
+                                                        GL_MAP_READ_BIT);
+    if (depth)
+    {
+        m_occlusionMap.build(depth, m_occlusionReadSize.x, m_occlusionReadSize.y,
+                             occlusionBlockSize, m_occlusionReadViewProj,
+                             m_occlusionReadViewSize, m_occlusionReadConservative);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glCheckError();
+}
+
+
+/// Start reading back the maximum depth over blocks of the incremental
+/// framebuffer, for occlusion culling in later frames.
+///
+/// The depth is reduced on the GPU and copied into a pixel buffer, so the
+/// read doesn't stall.  Nothing is done while a previous read is in flight.
+void View3D::requestOcclusionMap(const TransformState& transState)
+{
+    if (m_occlusionReadFence || !m_depthDownsampleShader ||
+        !m_depthDownsampleShader->isValid())
+        return;
+    GLint prevFramebuffer = 0;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &prevFramebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_occlusionFramebuffer.id());
+    glViewport(0, 0, m_occlusionReadSize.x, m_occlusionReadSize.y);
+
+    QOpenGLShaderProgram& prog = m_depthDownsampleShader->shaderProgram();
+    prog.bind();
+    prog.setUniformValue("depthTex", 0);
+    prog.setUniformValue("blockSize", occlusionBlockSize);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, m_incrementalFramebuffer.depthTexture());
+    glDisable(GL_BLEND);
+    glDisable(GL_STENCIL_TEST);
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_ALWAYS);
+    glDepthMask(GL_TRUE);
+    glBindVertexArray(m_emptyVertexArray);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindVertexArray(0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    prog.release();
+    glDepthFunc(GL_LEQUAL);
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, m_occlusionFramebuffer.id());
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, m_occlusionPixelBuffer);
+    glBufferData(GL_PIXEL_PACK_BUFFER,
+                 sizeof(float)*m_occlusionReadSize.x*m_occlusionReadSize.y,
+                 NULL, GL_STREAM_READ);
+    glReadPixels(0, 0, m_occlusionReadSize.x, m_occlusionReadSize.y,
+                 GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    m_occlusionReadFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    m_occlusionReadViewProj = transState.modelViewMatrix * transState.projMatrix;
+    m_occlusionReadViewSize = transState.viewSize;
+    // Depth of reprojected pixels may hide points which are really visible
+    m_occlusionReadConservative = !m_frameReprojected;
+
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, prevFramebuffer);
+    glViewport(0, 0, transState.viewSize.x, transState.viewSize.y);
+    glCheckError();
+}
+
+
+/// Copy the incremental framebuffer to the screen, filling holes between
+/// sparse points if enabled.
+///
+/// The accumulated frame itself is never modified by hole filling, so that
+/// the filled pixels don't obscure points drawn in later incremental frames.
+void View3D::displayFrame(const TransformState& transState, int w, int h)
+{
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    if (!m_fillHoles || !m_holeFillShader || !m_holeFillShader->isValid())
+    {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, m_incrementalFramebuffer.id());
+        glBlitFramebuffer(0,0,w,h, 0,0,w,h,
+                          GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT, GL_NEAREST); // has to be GL_NEAREST to work with DEPTH
+        glCheckError();
+        return;
+    }
+
+    QOpenGLShaderProgram& prog = m_holeFillShader->shaderProgram();
+    prog.bind();
+    transState.setUniforms(prog.programId());
+    prog.setUniformValue("colorTex", 0);
+    prog.setUniformValue("depthTex", 1);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, m_incrementalFramebuffer.colorTexture());
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, m_incrementalFramebuffer.depthTexture());
+
+    // Every pixel is written, including depth for the overlays drawn later
+    glDisable(GL_BLEND);
+    glDisable(GL_STENCIL_TEST);
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_ALWAYS);
+
+    glBindVertexArray(m_emptyVertexArray);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindVertexArray(0);
+
+    glDepthFunc(GL_LEQUAL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    prog.release();
+    glCheckError();
+}
+
+
+/// Draw the previous frame, reprojected into the current view, into the
+/// currently bound framebuffer.
+///
+/// Each pixel of the previous frame is unprojected using its depth and drawn
+/// as a point in the new view, so during slow camera motion most of the
+/// accumulated detail is kept and the frame's point budget goes to filling
+/// disoccluded holes.
+void View3D::reprojectPreviousFrame(const TransformState& transState)
+{
+    if (!m_reprojectShader || !m_reprojectShader->isValid())
+        return;
+    const M44d viewProj = transState.modelViewMatrix * transState.projMatrix;
+    const M44d reprojection = m_prevViewProjMatrix.inverse() * viewProj;
+
+    QOpenGLShaderProgram& prog = m_reprojectShader->shaderProgram();
+    prog.bind();
+    TransformState::setUniform(prog.programId(), "reprojectionMatrix", reprojection);
+    prog.setUniformValue("prevColor", 0);
+    prog.setUniformValue("prevDepth", 1);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, m_prevFramebuffer.colorTexture());
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, m_prevFramebuffer.depthTexture());
+
+    glDisable(GL_BLEND);
+    glDisable(GL_STENCIL_TEST);
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glBindVertexArray(m_emptyVertexArray);
+    glDrawArrays(GL_POINTS, 0, viewport[2]*viewport[3]);
+    glBindVertexArray(0);
+
+    glDisable(GL_VERTEX_PROGRAM_POINT_SIZE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    prog.release();
+    glCheckError();
 }
 
 void View3D::drawMeshes(const TransformState& transState,
@@ -1119,7 +1596,10 @@ void View3D::drawGrid() const
 /// Draw point cloud
 DrawCount View3D::drawPoints(const TransformState& transState,
                              const std::vector<const Geometry*>& geoms,
-                             double quality, bool incrementalDraw)
+                             const std::vector<int>& fileNumbers,
+                             const std::vector<double>& qualities,
+                             bool incrementalDraw,
+                             const OcclusionMap* occlusion)
 {
     glCheckError();
 
@@ -1144,7 +1624,26 @@ DrawCount View3D::drawPoints(const TransformState& transState,
     QOpenGLShaderProgram& prog = m_shaderProgram->shaderProgram();
     prog.bind();
     m_shaderProgram->setUniforms();
-    QModelIndexList selection = m_selectionModel->selectedRows();
+
+    // Prepare draw lists on the draw worker in the same order as the
+    // geometries are submitted below, so that CPU side culling and level of
+    // detail selection overlaps with OpenGL submission.  Geometries hand
+    // over their draw lists in chunks as they're built, so this works even
+    // for a single large geometry.
+    for (const Geometry* geom : geoms)
+    {
+        if (geom->pointCount())
+            geom->schedulePrepareDrawPoints();
+    }
+    m_drawWorker.run([&]()
+    {
+        for (size_t i = 0; i < geoms.size(); ++i)
+        {
+            if (geoms[i]->pointCount())
+                geoms[i]->prepareDrawPoints(transState, qualities[i], incrementalDraw, occlusion);
+        }
+    });
+
     for (size_t i = 0; i < geoms.size(); ++i)
     {
         const Geometry& geom = *geoms[i];
@@ -1154,10 +1653,11 @@ DrawCount View3D::drawPoints(const TransformState& transState,
         }
         V3f relCursor = m_cursorPos - geom.offset();
         prog.setUniformValue("cursorPos", relCursor.x, relCursor.y, relCursor.z);
-        prog.setUniformValue("fileNumber", (GLint)(selection[(int)i].row() + 1));
+        prog.setUniformValue("fileNumber", (GLint)fileNumbers[i]);
         prog.setUniformValue("pointPixelScale", (GLfloat)(0.5*width()*dPR*m_camera.projectionMatrix()[0][0]));
-        totDrawCount += geom.drawPoints(prog, transState, quality, incrementalDraw);
+        totDrawCount += geom.drawPoints(prog, transState, qualities[i], incrementalDraw, occlusion);
     }
+    m_drawWorker.wait();
 
     glEnable(GL_DEPTH_TEST);
     glDisable(GL_STENCIL_TEST);
@@ -1206,44 +1706,92 @@ bool View3D::snapToGeometry(const Imath::V3d& pos, double normalScaling,
     V3d cameraPos = m_camera.position();
     V3d viewDir = (pos - cameraPos).normalized();
     EllipticalDist distFunc(pos, viewDir, normalScaling);
-    double nearestDist = DBL_MAX;
-    // Snap cursor to position of closest point and center on it
-    QModelIndexList sel = m_selectionModel->selectedRows();
-    for (int i = 0; i < sel.size(); ++i)
+    // Pick on all selected geometries concurrently.  The distance to the
+    // closest vertex found so far is shared, so that each search can give up
+    // as soon as it can't improve on the others.
+    struct Pick
     {
-        int geomIdx = sel[i].row();
-        V3d pickedVertex;
-        double dist = 0;
+        bool found = false;
+        V3d vertex;
+        double dist = DBL_MAX;
         std::string info;
-        if (m_geometries->get()[geomIdx]->pickVertex(cameraPos, distFunc,
-                                                    pickedVertex, &dist,
-                                                    (pointInfo != 0) ? &info : 0))
+    };
+    std::vector<const Geometry*> geoms = selectedGeometry();
+    std::vector<Pick> picks(geoms.size());
+    std::atomic<double> distBound(DBL_MAX);
+    parallelFor(0, geoms.size(), [&](size_t i)
+    {
+        Pick& pick = picks[i];
+        pick.found = geoms[i]->pickVertex(cameraPos, distFunc, pick.vertex, &pick.dist,
+                                          (pointInfo != 0) ? &pick.info : 0, &distBound);
+    });
+    // Snap cursor to position of closest point and center on it
+    double nearestDist = DBL_MAX;
+    for (const Pick& pick : picks)
+    {
+        if (pick.found && pick.dist < nearestDist)
         {
-            if (dist < nearestDist)
-            {
-                *newPos = pickedVertex;
-                nearestDist = dist;
-                if (pointInfo)
-                    *pointInfo = QString::fromStdString(info);
-            }
+            *newPos = pick.vertex;
+            nearestDist = pick.dist;
+            if (pointInfo)
+                *pointInfo = QString::fromStdString(pick.info);
         }
     }
     return nearestDist < DBL_MAX;
 }
 
 
-/// Return list of currently selected geometry
-std::vector<const Geometry*> View3D::selectedGeometry() const
+/// Return selected geometries, and optionally their file numbers (one plus
+/// the row index) for use in shaders.
+std::vector<const Geometry*> View3D::selectedGeometry(std::vector<int>* fileNumbers) const
 {
     const GeometryCollection::GeometryVec& geomAll = m_geometries->get();
     QModelIndexList sel = m_selectionModel->selectedRows();
     std::vector<const Geometry*> geoms;
     geoms.reserve(sel.size());
+    if (fileNumbers)
+        fileNumbers->clear();
     for (int i = 0; i < sel.size(); ++i)
+    {
         geoms.push_back(geomAll[sel[i].row()].get());
+        if (fileNumbers)
+            fileNumbers->push_back(sel[i].row() + 1);
+    }
     return geoms;
 }
 
+
+/// Find the selected geometries whose bounding boxes intersect the view
+/// frustum, along with their file numbers.
+///
+/// The selection is cached along with a bounding volume hierarchy so that
+/// the per frame cost depends only on the number of visible geometries.
+void View3D::visibleGeometry(const TransformState& transState,
+                             std::vector<const Geometry*>& geoms,
+                             std::vector<int>& fileNumbers)
+{
+    if (!m_selectionCacheValid)
+    {
+        m_selectedGeoms = selectedGeometry(&m_selectedFileNumbers);
+        std::vector<Imath::Box3d> boxes;
+        boxes.reserve(m_selectedGeoms.size());
+        for (const Geometry* geom : m_selectedGeoms)
+            boxes.push_back(geom->boundingBox());
+        m_selectionBvh.build(boxes);
+        m_selectionCacheValid = true;
+    }
+    m_selectionBvh.findVisible(transState, m_visibleSelection);
+    geoms.clear();
+    fileNumbers.clear();
+    geoms.reserve(m_visibleSelection.size());
+    fileNumbers.reserve(m_visibleSelection.size());
+    for (size_t i : m_visibleSelection)
+    {
+        geoms.push_back(m_selectedGeoms[i]);
+        fileNumbers.push_back(m_selectedFileNumbers[i]);
+    }
+}
+
 void View3D::readSettings(const QSettings& settings)
 {
     m_drawBoundingBoxes = settings.value("boundingBoxes", m_drawBoundingBoxes).toBool();
@@ -1251,6 +1799,11 @@ void View3D::readSettings(const QSettings& settings)
     m_drawAxes          = settings.value("axes", m_drawAxes).toBool();
     m_drawGrid          = settings.value("grid", m_drawGrid).toBool();
     m_drawAnnotations   = settings.value("annotations", m_drawAnnotations).toBool();
+    m_fillHoles         = settings.value("fillHoles", m_fillHoles).toBool();
+    m_cacheLayers       = settings.value("cacheLayers", m_cacheLayers).toBool();
+    m_occlusionCulling  = settings.value("occlusionCulling", m_occlusionCulling).toBool();
+    m_layerCacheMaxBytes = size_t(1024*1024)*settings.value("layerCacheMegabytes",
+                               int(m_layerCacheMaxBytes/(1024*1024))).toInt();
     m_backgroundColor   = settings.value("background", m_backgroundColor).value<QColor>();
 
     m_boundingBoxAction->setChecked(m_drawBoundingBoxes);
@@ -1258,6 +1811,9 @@ void View3D::readSettings(const QSettings& settings)
     m_axesAction->setChecked(m_drawAxes);
     m_gridAction->setChecked(m_drawGrid);
     m_annotationAction->setChecked(m_drawAnnotations);
+    m_fillHolesAction->setChecked(m_fillHoles);
+    m_cacheLayersAction->setChecked(m_cacheLayers);
+    m_occlusionCullingAction->setChecked(m_occlusionCulling);
 }
 
 void View3D::writeSettings(QSettings& settings) const
@@ -1267,6 +1823,10 @@ void View3D::writeSettings(QSettings& settings) const
     settings.setValue("axes", m_drawAxes);
     settings.setValue("grid", m_drawGrid);
     settings.setValue("annotations", m_drawAnnotations);
+    settings.setValue("fillHoles", m_fillHoles);
+    settings.setValue("cacheLayers", m_cacheLayers);
+    settings.setValue("occlusionCulling", m_occlusionCulling);
+    settings.setValue("layerCacheMegabytes", int(m_layerCacheMaxBytes/(1024*1024)));
     settings.setValue("background", QVariant(m_backgroundColor));
 }
 
@@ -4,13 +4,16 @@
 #pragma once
 
 #include <cmath>
+#include <cstdint>
 #include <vector>
 #include <memory>
+#include <unordered_map>
 
 #include "glutil.h"
 #define QT_NO_OPENGL_ES_2
 
 
+#include <QElapsedTimer>
 #include <QVector>
 #include <QGLWidget>
 #include <QModelIndex>
@@ -18,6 +21,8 @@
 #include "DrawCostModel.h"
 #include "InteractiveCamera.h"
 #include "geometrycollection.h"
+#include "SceneBvh.h"
+#include "OcclusionMap.h"
 #include "Annotation.h"
 #include "Enable.h"
 #include "ShaderProgram.h"
@@ -73,6 +78,9 @@ class View3D : public QGLWidget
         QAction* m_axesAction = nullptr;
         QAction* m_gridAction = nullptr;
         QAction* m_annotationAction = nullptr;
+        QAction* m_fillHolesAction = nullptr;
+        QAction* m_cacheLayersAction = nullptr;
+        QAction* m_occlusionCullingAction = nullptr;
 
         /// Settings
         void readSettings(const QSettings& settings);
@@ -100,9 +108,12 @@ class View3D : public QGLWidget
 
     private slots:
         void restartRender();
+        void cameraChanged();
+        void selectionChanged();
         void setupShaderParamUI();
 
         void geometryChanged();
+        void geometryDataAvailable();
         void dataChanged(const QModelIndex &topLeft, const QModelIndex &bottomRight);
         void geometryInserted(const QModelIndex&, int firstRow, int lastRow);
 
@@ -111,6 +122,9 @@ class View3D : public QGLWidget
         void setAxes(bool);
         void setGrid(bool);
         void setAnnotations(bool);
+        void setFillHoles(bool);
+        void setCacheLayers(bool);
+        void setOcclusionCulling(bool);
 
     private:
         double getDevicePixelRatio();
@@ -127,9 +141,27 @@ class View3D : public QGLWidget
 
         void drawText(const QString& text);
 
+        void reprojectPreviousFrame(const TransformState& transState);
+        void displayFrame(const TransformState& transState, int w, int h);
+
+        void readOcclusionMap();
+        void requestOcclusionMap(const TransformState& transState);
+
+        /// Draw points of each of `geoms` with the corresponding quality
+        /// from `qualities`, skipping those hidden in `occlusion`
         DrawCount drawPoints(const TransformState& transState,
                              const std::vector<const Geometry*>& geoms,
-                             double quality, bool incrementalDraw);
+                             const std::vector<int>& fileNumbers,
+                             const std::vector<double>& qualities,
+                             bool incrementalDraw,
+                             const OcclusionMap* occlusion);
+
+        DrawCount drawLayers(const TransformState& transState,
+                             const std::vector<const Geometry*>& geoms,
+                             const std::vector<int>& fileNumbers,
+                             const std::vector<double>& qualities);
+        void evictLayers(size_t maxLayers);
+        void compositeLayer(const Framebuffer& layer);
 
         void drawMeshes(const TransformState& transState,
                         const std::vector<const Geometry*>& geoms) const;
@@ -143,7 +175,10 @@ class View3D : public QGLWidget
                             Imath::V3d* newPos, QString* pointInfo);
 
         void snapToPoint(const Imath::V3d& pos);
-        std::vector<const Geometry*> selectedGeometry() const;
+        std::vector<const Geometry*> selectedGeometry(std::vector<int>* fileNumbers = nullptr) const;
+        void visibleGeometry(const TransformState& transState,
+                             std::vector<const Geometry*>& geoms,
+                             std::vector<int>& fileNumbers);
 
         MainWindow* m_mainWindow = nullptr;
         DataSetUI* m_dataSet = nullptr;
@@ -165,6 +200,8 @@ class View3D : public QGLWidget
         bool m_drawAxes = true;
         bool m_drawGrid = false;
         bool m_drawAnnotations = true;
+        /// Option to fill holes between sparse points when displaying
+        bool m_fillHoles = false;
         /// If true, OpenGL initialization didn't work properly
         bool m_badOpenGL;
         /// Shader for point clouds
@@ -176,6 +213,13 @@ class View3D : public QGLWidget
         /// Collection of geometries
         GeometryCollection* m_geometries;
         QItemSelectionModel* m_selectionModel = nullptr;
+        /// Selected geometry and a spatial index over it, cached between
+        /// frames until the selection or the geometry changes
+        bool m_selectionCacheValid = false;
+        std::vector<const Geometry*> m_selectedGeoms;
+        std::vector<int> m_selectedFileNumbers;
+        SceneBvh m_selectionBvh;
+        std::vector<size_t> m_visibleSelection;
         QVector<std::shared_ptr<Annotation>> m_annotations;
         /// UI widget for shader
         QWidget* m_shaderParamsUI;
@@ -183,8 +227,68 @@ class View3D : public QGLWidget
         QTimer* m_incrementalFrameTimer;
         Framebuffer m_incrementalFramebuffer;
         bool m_incrementalDraw;
+        /// Previous accumulated frame, for reprojection after camera motion
+        Framebuffer m_prevFramebuffer;
+        M44d m_prevViewProjMatrix;
+        /// True if m_prevFramebuffer shows the current scene, as seen from
+        /// the previous camera
+        bool m_prevFrameValid = false;
+        /// True if the accumulated frame was seeded by reprojection
+        bool m_frameReprojected = false;
+        /// Time since the camera last moved
+        QElapsedTimer m_cameraStillTimer;
+        std::unique_ptr<ShaderProgram> m_reprojectShader;
+        std::unique_ptr<ShaderProgram> m_holeFillShader;
+        /// Cached color and depth of a single geometry at the current camera
+        struct GeometryLayer
+        {
+            Framebuffer framebuffer;
+            bool valid = false;        ///< Up to date with camera and scene
+            bool moreToDraw = true;    ///< Incremental drawing is unfinished
+            uint64_t lastUsedFrame = 0;
+        };
+        /// Option to render each geometry into its own cached layer, so that
+        /// changing the selection doesn't restart drawing
+        bool m_cacheLayers = false;
+        /// Memory limit for cached layers
+        size_t m_layerCacheMaxBytes = size_t(512)*1024*1024;
+        /// True when all layers need redrawing after a camera or scene change
+        bool m_invalidateLayers = false;
+        uint64_t m_frameNumber = 0;
+        std::unordered_map<const Geometry*, std::unique_ptr<GeometryLayer>> m_layers;
+        std::unique_ptr<ShaderProgram> m_layerCompositeShader;
+        /// Option to skip points hidden behind those drawn in earlier frames.
+        /// Off by default, since culling with an occlusion map from an older
+        /// camera is heuristic.
+        bool m_occlusionCulling = false;
+        /// Depth pyramid of a recent frame for occlusion culling
+        OcclusionMap m_occlusionMap;
+        /// Asynchronous read back of downsampled depth for m_occlusionMap.
+        /// At most one read is in flight, signalled by m_occlusionReadFence.
+        static const int occlusionBlockSize = 8;
+        Framebuffer m_occlusionFramebuffer;
+        Imath::V2i m_occlusionReadSize = Imath::V2i(0);
+        GLuint m_occlusionPixelBuffer = 0;
+        GLsync m_occlusionReadFence = 0;
+        M44d m_occlusionReadViewProj;
+        Imath::V2i m_occlusionReadViewSize = Imath::V2i(0);
+        /// True if the read in flight is of a frame without reprojected
+        /// pixels
+        bool m_occlusionReadConservative = false;
+        /// True if the read in flight is of a scene which has since changed
+        bool m_occlusionReadStale = false;
+        std::unique_ptr<ShaderProgram> m_depthDownsampleShader;
+        /// Empty vertex array for passes which generate vertices from
+        /// gl_VertexID (core profile still requires one to be bound)
+        GLuint m_emptyVertexArray = 0;
+        /// Worker which prepares draw lists while drawPoints() submits
+        /// earlier ones to OpenGL
+        ThreadPool m_drawWorker{1};
         /// Controller for amount of geometry to draw
         DrawCostModel m_drawCostModel;
+        /// GPU timing for the cost model: draw count and CPU submission time
+        /// for each timed frame
+        TimerQueryRing<std::pair<DrawCount,double>> m_frameTimerQueries;
         /// GL textures
         std::unique_ptr<QOpenGLTexture> m_drawAxesBackground;
         std::unique_ptr<QOpenGLTexture> m_drawAxesLabelX;
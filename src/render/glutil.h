@@ -18,6 +18,7 @@
 #include <QImage>
 #include <QGLWidget>
 
+#include <algorithm>
 #include <vector>
 #include <cassert>
 
@@ -149,6 +150,9 @@ private:
 /// Framebuffer resource wrapper with color and depth attachements for the
 /// particular framebuffer settings needed in the incremental framebuffer in
 /// View3D.cpp
+///
+/// The attachments are textures so that a previous frame can be sampled when
+/// reprojecting it into a new view.
 class Framebuffer
 {
     public:
@@ -159,6 +163,9 @@ class Framebuffer
             destroy();
         }
 
+        Framebuffer(const Framebuffer&) = delete;
+        Framebuffer& operator=(const Framebuffer&) = delete;
+
         /// Initialize framebuffer with given width and height.
         void init(int width, int height);
 
@@ -166,13 +173,21 @@ class Framebuffer
         {
             if (m_fbo != 0)
                 glDeleteFramebuffers(1, &m_fbo);
-            if (m_colorBuf != 0)
-                glDeleteRenderbuffers(1, &m_colorBuf);
-            if (m_zBuf != 0)
-                glDeleteRenderbuffers(1, &m_zBuf);
+            if (m_colorTex != 0)
+                glDeleteTextures(1, &m_colorTex);
+            if (m_depthTex != 0)
+                glDeleteTextures(1, &m_depthTex);
             m_fbo = 0;
-            m_colorBuf = 0;
-            m_zBuf = 0;
+            m_colorTex = 0;
+            m_depthTex = 0;
+        }
+
+        /// Exchange OpenGL resources with `other`
+        void swap(Framebuffer& other)
+        {
+            std::swap(m_fbo, other.m_fbo);
+            std::swap(m_colorTex, other.m_colorTex);
+            std::swap(m_depthTex, other.m_depthTex);
         }
 
         /// Get OpenGL identifier for the buffer
@@ -182,10 +197,111 @@ class Framebuffer
             return m_fbo;
         }
 
+        /// Get OpenGL identifier for the RGBA8 color texture
+        GLuint colorTexture() const { return m_colorTex; }
+        /// Get OpenGL identifier for the depth-stencil texture
+        GLuint depthTexture() const { return m_depthTex; }
+
     private:
         GLuint m_fbo = 0;
-        GLuint m_colorBuf = 0;
-        GLuint m_zBuf = 0;
+        GLuint m_colorTex = 0;
+        GLuint m_depthTex = 0;
+};
+
+
+//------------------------------------------------------------------------------
+/// Ring of OpenGL timer queries for measuring GPU time without stalling
+///
+/// Each timed interval is bracketed by begin() and end().  The results
+/// arrive a few frames later and are collected in order with poll(), so the
+/// CPU never has to wait for the GPU to catch up as it would with glFinish().
+/// A `Payload` is stored with each interval so that the caller can match up
+/// results with whatever was drawn.
+template<typename Payload>
+class TimerQueryRing
+{
+    public:
+        TimerQueryRing() = default;
+        ~TimerQueryRing()
+        {
+            destroy();
+        }
+
+        /// Create the query objects.  Returns false if timer queries aren't
+        /// supported by the OpenGL implementation.
+        bool init()
+        {
+            destroy();
+            if (!GLEW_VERSION_3_3 && !GLEW_ARB_timer_query)
+                return false;
+            glGenQueries(ringSize, m_queries);
+            return true;
+        }
+
+        void destroy()
+        {
+            if (m_queries[0] != 0)
+                glDeleteQueries(ringSize, m_queries);
+            std::fill(m_queries, m_queries + ringSize, 0);
+            m_first = 0;
+            m_numPending = 0;
+            m_active = false;
+        }
+
+        /// Return true if timer queries are available
+        bool isValid() const { return m_queries[0] != 0; }
+
+        /// Begin timing an interval.  Returns false if the interval can't be
+        /// timed because all queries are still waiting for results.
+        bool begin()
+        {
+            if (!isValid() || m_numPending == ringSize)
+                return false;
+            glBeginQuery(GL_TIME_ELAPSED, m_queries[nextIndex()]);
+            m_active = true;
+            return true;
+        }
+
+        /// End the interval started with begin(), associating `payload` with it
+        void end(const Payload& payload)
+        {
+            if (!m_active)
+                return;
+            glEndQuery(GL_TIME_ELAPSED);
+            m_payloads[nextIndex()] = payload;
+            ++m_numPending;
+            m_active = false;
+        }
+
+        /// Retrieve the oldest timing result if it's available, without
+        /// blocking.  Returns false if there's no result ready.
+        bool poll(double& millisecs, Payload& payload)
+        {
+            if (m_numPending == 0)
+                return false;
+            GLint available = 0;
+            glGetQueryObjectiv(m_queries[m_first], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                return false;
+            GLuint64 nanosecs = 0;
+            glGetQueryObjectui64v(m_queries[m_first], GL_QUERY_RESULT, &nanosecs);
+            millisecs = nanosecs/1e6;
+            payload = m_payloads[m_first];
+            m_first = (m_first + 1) % ringSize;
+            --m_numPending;
+            return true;
+        }
+
+    private:
+        static const int ringSize = 4;
+
+        int nextIndex() const { return (m_first + m_numPending) % ringSize; }
+
+        GLuint m_queries[ringSize] = {0};
+        Payload m_payloads[ringSize];
+        int m_first = 0;       ///< Index of oldest pending query
+        int m_numPending = 0;  ///< Number of queries waiting for results
+        bool m_active = false; ///< True between begin() and end()
 };
 
 
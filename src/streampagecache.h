@@ -6,38 +6,110 @@
 
 #include <algorithm>
 #include <cassert>
+#include <condition_variable>
 #include <cstdint>
 #include <fstream>
 #include <functional>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <string.h>
 #include <stdexcept>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "util.h"
 
 /// Application controlled page cache for access to raw file data
 ///
 /// This interface allows the application to specify data to be fetched, along
 /// with a priority for the data.
+///
+/// Pages may be fetched synchronously with fetchNow(), or continuously by a
+/// background thread (see startBackgroundFetch()).  All functions are safe to
+/// call while the background thread is running; they only wait for access
+/// to the cache data structures, never for file IO.
+///
+/// The cache size may be limited with setMaxSize(), in which case the least
+/// recently read pages are evicted to make room for newly fetched ones.
+///
+/// On POSIX systems a file may instead be memory mapped.  Fetching is then
+/// left to the operating system via madvise(), with residency checked by
+/// mincore(), and cached data may be accessed in place using data().
 class StreamPageCache
 {
     public:
         typedef uint64_t PosType;
 
         StreamPageCache(std::istream& input, PosType pageSize = 512*1024)
-            : m_input(input),
-            m_pageSize(pageSize)
+            : m_input(&input),
+            m_map(0),
+            m_pageSize(pageSize),
+            m_osPageSize(1),
+            m_maxSize(std::numeric_limits<PosType>::max()),
+            m_numStoredPages(0),
+            m_useCounter(0),
+            m_hits(0),
+            m_misses(0),
+            m_stopFetch(false)
         {
-            m_input.seekg(0, std::ios::end);
-            m_fileSize = static_cast<PosType>(m_input.tellg());
-            m_input.seekg(0);
-            if (!m_input)
+            m_input->seekg(0, std::ios::end);
+            m_fileSize = static_cast<PosType>(m_input->tellg());
+            m_input->seekg(0);
+            if (!*m_input)
                 throw DisplazError("Page cache could not open file");
         }
 
+#ifndef _WIN32
+        /// Create a cache for a memory mapped view of the file `fileName`
+        explicit StreamPageCache(const std::string& fileName, PosType pageSize = 512*1024)
+            : m_input(0),
+            m_map(0),
+            m_pageSize(pageSize),
+            m_fileSize(0),
+            m_osPageSize(sysconf(_SC_PAGESIZE)),
+            m_maxSize(std::numeric_limits<PosType>::max()),
+            m_numStoredPages(0),
+            m_useCounter(0),
+            m_hits(0),
+            m_misses(0),
+            m_stopFetch(false)
+        {
+            int fd = open(fileName.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw DisplazError("Page cache could not open file %s", fileName);
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0)
+            {
+                m_fileSize = st.st_size;
+                void* map = mmap(0, m_fileSize, PROT_READ, MAP_SHARED, fd, 0);
+                if (map != MAP_FAILED)
+                    m_map = static_cast<const char*>(map);
+            }
+            close(fd);
+            if (!m_map)
+                throw DisplazError("Page cache could not map file %s", fileName);
+        }
+#endif
+
+        ~StreamPageCache()
+        {
+            stopBackgroundFetch();
+#ifndef _WIN32
+            if (m_map)
+                munmap(const_cast<char*>(m_map), m_fileSize);
+#endif
+        }
+
         /// Mark pages overlapping the given range for fetching
         ///
         /// Page priority is taken as the maximum of any fetch requests which
@@ -55,20 +127,50 @@ class StreamPageCache
             }
             PosType pagesBegin = pageIndex(offset);
             PosType pagesEnd = pageIndex(offset + length - 1) + 1;
+            // For mapped files, check OS residency of the whole range with a
+            // single call, made without holding m_mutex.  This is only
+            // needed if some of the pages aren't cached already.
+            std::vector<bool> resident;
+            if (m_map && !allCached(pagesBegin, pagesEnd))
+                resident = residentPages(pagesBegin, pagesEnd);
             bool inCache = true;
+            std::lock_guard<std::mutex> lock(m_mutex);
             for (PosType pageIdx = pagesBegin; pageIdx < pagesEnd; ++pageIdx)
             {
-                auto page = m_pages.find(pageIdx);
-                if (page == m_pages.end())
+                if (m_pages.find(pageIdx) != m_pages.end())
+                    continue;
+                if (!resident.empty() && resident[pageIdx - pagesBegin])
+                {
+                    // Already read by the OS, so no need to fetch
+                    insertPage(pageIdx, std::unique_ptr<char[]>());
+                    continue;
+                }
+                inCache = false;
+                if (m_fetchingPages.find(pageIdx) != m_fetchingPages.end())
+                    continue;
+                auto pendingPage = m_pendingPages.find(pageIdx);
+                if (pendingPage == m_pendingPages.end())
+                    m_pendingPages[pageIdx] = PendingPage{priority, true};
+                else if (!pendingPage->second.renewed)
+                    pendingPage->second = PendingPage{priority, true};
+                else if (pendingPage->second.priority < priority)
+                    pendingPage->second.priority = priority;
+            }
+            if (!inCache)
+            {
+#ifndef _WIN32
+                // Start OS readahead, which usually completes before the
+                // pages are fetched
+                if (m_map)
                 {
-                    auto pendingPage = m_pendingPages.find(pageIdx);
-                    if (pendingPage == m_pendingPages.end())
-                        m_pendingPages[pageIdx] = priority;
-                    else if (pendingPage->second < priority)
-                        pendingPage->second = priority;
-                    inCache = false;
+                    PosType begin = offset - offset % m_osPageSize;
+                    madvise(const_cast<char*>(m_map) + begin, offset + length - begin,
+                            MADV_WILLNEED);
                 }
+#endif
+                m_fetchRequested.notify_one();
             }
+            evictPages();
             return inCache;
         }
 
@@ -81,14 +183,17 @@ class StreamPageCache
             PosType pagesBegin = pageIndex(offset);
             PosType pagesEnd = pageIndex(offset + length - 1) + 1;
             //tfm::printf("read(): pagesBegin = %d, pagesEnd = %d\n", pagesBegin, pagesEnd);
+            std::lock_guard<std::mutex> lock(m_mutex);
             for (PosType pageIdx = pagesBegin; pageIdx < pagesEnd; ++pageIdx)
             {
                 auto page = m_pages.find(pageIdx);
                 if (page == m_pages.end())
                 {
                     //tfm::printf("Didn't find page %d\n", pageIdx);
+                    ++m_misses;
                     return false;
                 }
+                page->second.lastUsed = ++m_useCounter;
                 PosType pageOffsetBegin = pageIdx * m_pageSize;
                 PosType pageOffsetEnd   = (pageIdx+1) * m_pageSize;
                 // Range of bytes to copy within page
@@ -98,49 +203,368 @@ class StreamPageCache
                                     offset + length - pageOffsetBegin : m_pageSize;
                 PosType nbytes = byteEnd - byteBegin;
                 //tfm::printf("read(): byteBegin = %d, byteEnd = %d\n", byteBegin, byteEnd);
-                memcpy(buf, page->second.get() + byteBegin, nbytes);
+                memcpy(buf, page->second.data + byteBegin, nbytes);
                 buf += nbytes;
             }
+            ++m_hits;
             return true;
         }
 
-        /// Fetch a bunch of pages which have been previously marked.
+        /// Return a pointer to `length` bytes of cached data at `offset`, or
+        /// null if the range isn't cached.
         ///
-        /// Eventually this will probably happen in the background
+        /// Only memory mapped caches hand out pointers; otherwise null is
+        /// always returned and read() must be used.  Pointers stay valid for
+        /// the lifetime of the cache, but access may block on IO once the
+        /// pages have been evicted.
+        const char* data(PosType offset, PosType length)
+        {
+            if (!m_map || length == 0)
+                return 0;
+            PosType pagesBegin = pageIndex(offset);
+            PosType pagesEnd = pageIndex(offset + length - 1) + 1;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (PosType pageIdx = pagesBegin; pageIdx < pagesEnd; ++pageIdx)
+            {
+                auto page = m_pages.find(pageIdx);
+                if (page == m_pages.end())
+                    return 0;
+                page->second.lastUsed = ++m_useCounter;
+            }
+            ++m_hits;
+            return m_map + offset;
+        }
+
+        /// Fetch up to `numFetch` of the highest priority pages which have
+        /// been previously marked, and return the number fetched.
+        ///
+        /// Marked pages adjacent to the chosen ones are fetched along with
+        /// them, so that each run of adjacent pages is read sequentially
+        /// with a single seek.  Because of this the number of pages fetched
+        /// may exceed `numFetch`.
         size_t fetchNow(size_t numFetch)
         {
-            typedef std::pair<double, PosType> PendingPage;
-            std::vector<PendingPage> priorityPages;
-            for (auto p = m_pendingPages.begin(); p != m_pendingPages.end(); ++p)
-                priorityPages.push_back(PendingPage(p->second, p->first));
-            numFetch = std::min(numFetch, priorityPages.size());
-            std::nth_element(priorityPages.begin(), priorityPages.begin() + numFetch,
-                             priorityPages.end(), std::greater<PendingPage>());
-            for (size_t i = 0; i < numFetch; ++i)
+            // Choose runs of pages, and mark them as being fetched so that a
+            // concurrent fetch won't read them too
+            typedef std::pair<PosType, PosType> PageRun;
+            std::vector<PageRun> runs;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                typedef std::pair<double, PosType> PriorityPage;
+                std::vector<PriorityPage> priorityPages;
+                for (auto p = m_pendingPages.begin(); p != m_pendingPages.end(); ++p)
+                    priorityPages.push_back(PriorityPage(p->second.priority, p->first));
+                numFetch = std::min(numFetch, priorityPages.size());
+                std::partial_sort(priorityPages.begin(), priorityPages.begin() + numFetch,
+                                  priorityPages.end(), std::greater<PriorityPage>());
+                for (size_t i = 0; i < numFetch; ++i)
+                {
+                    PosType pageIdx = priorityPages[i].second;
+                    if (m_pendingPages.find(pageIdx) == m_pendingPages.end())
+                        continue; // Already part of a run
+                    PosType begin = pageIdx;
+                    PosType end = pageIdx + 1;
+                    while (end - begin < maxRunLength &&
+                           m_pendingPages.find(end) != m_pendingPages.end())
+                        ++end;
+                    while (begin > 0 && end - begin < maxRunLength &&
+                           m_pendingPages.find(begin - 1) != m_pendingPages.end())
+                        --begin;
+                    for (PosType j = begin; j < end; ++j)
+                    {
+                        m_pendingPages.erase(j);
+                        m_fetchingPages.insert(j);
+                    }
+                    runs.push_back(PageRun(begin, end));
+                }
+            }
+            // Read runs in priority order
+            size_t numFetched = 0;
+            for (const PageRun& run : runs)
+            {
+                std::vector<std::unique_ptr<char[]>> bufs;
+                if (m_map)
+                {
+                    // Fault the pages in, so that later access doesn't block
+                    PosType begin = run.first*m_pageSize;
+                    PosType end = std::min(run.second*m_pageSize, m_fileSize);
+                    volatile char sink = 0;
+                    for (PosType i = begin - begin % m_osPageSize; i < end; i += m_osPageSize)
+                        sink += m_map[i];
+                    bufs.resize(run.second - run.first);
+                }
+                else
+                {
+                    std::lock_guard<std::mutex> inputLock(m_inputMutex);
+                    m_input->seekg(run.first*m_pageSize);
+                    for (PosType pageIdx = run.first; pageIdx < run.second; ++pageIdx)
+                    {
+                        std::unique_ptr<char[]> buf(new char[m_pageSize]);
+                        PosType pageOffset = pageIdx*m_pageSize;
+                        m_input->read(buf.get(), std::min(m_pageSize, m_fileSize - pageOffset));
+                        bufs.push_back(std::move(buf));
+                    }
+                }
+                std::lock_guard<std::mutex> lock(m_mutex);
+                for (PosType pageIdx = run.first; pageIdx < run.second; ++pageIdx)
+                {
+                    insertPage(pageIdx, std::move(bufs[pageIdx - run.first]));
+                    m_fetchingPages.erase(pageIdx);
+                }
+                numFetched += bufs.size();
+                evictPages();
+            }
+            return numFetched;
+        }
+
+        /// Limit the total size of cached pages to `maxSize` bytes
+        ///
+        /// For mapped files the page data is owned by the OS, so this
+        /// instead limits how many pages are tracked as resident.
+        void setMaxSize(PosType maxSize)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_maxSize = maxSize;
+            evictPages();
+        }
+
+        /// Cache usage statistics
+        struct Stats
+        {
+            PosType sizeBytes;   ///< Size of page storage owned by the cache
+            PosType mappedBytes; ///< Size of cached pages of a file mapping
+            uint64_t hits;       ///< Number of successful calls to read()
+            uint64_t misses;     ///< Number of failed calls to read()
+        };
+
+        Stats stats() const
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            PosType numMapped = m_pages.size() - m_numStoredPages;
+            Stats s = {m_numStoredPages*m_pageSize, numMapped*m_pageSize, m_hits, m_misses};
+            return s;
+        }
+
+        /// Start fetching marked pages in a background thread, in priority
+        /// order.
+        ///
+        /// `pagesFetched` is called from the background thread each time a
+        /// batch of pages has been added to the cache.
+        void startBackgroundFetch(std::function<void()> pagesFetched = std::function<void()>())
+        {
+            stopBackgroundFetch();
+            m_stopFetch = false;
+            m_fetchThread = std::thread(&StreamPageCache::fetchLoop, this, pagesFetched);
+        }
+
+        /// Stop the background fetch thread, waiting for any page read in
+        /// progress to complete
+        void stopBackgroundFetch()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stopFetch = true;
+            }
+            m_fetchRequested.notify_one();
+            if (m_fetchThread.joinable())
+                m_fetchThread.join();
+        }
+
+        /// Discard marked pages which haven't been marked again by
+        /// prefetch() since the previous call.
+        ///
+        /// Users which repeat their prefetch requests every frame can call
+        /// this at the start of each frame, so that fetching follows the
+        /// current view rather than fetching pages which are no longer
+        /// wanted.  Pages marked again after this get their new priority.
+        void discardStaleRequests()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto p = m_pendingPages.begin(); p != m_pendingPages.end();)
             {
-                PosType pageIdx = priorityPages[i].second;
-                std::unique_ptr<char[]>& buf = m_pages[pageIdx];
-                assert(!buf);
-                buf.reset(new char[m_pageSize]);
-                PosType pageOffset = pageIdx*m_pageSize;
-                m_input.seekg(pageOffset);
-                m_input.read(buf.get(), std::min(m_pageSize, m_fileSize - pageOffset));
-                m_pendingPages.erase(pageIdx);
+                if (!p->second.renewed)
+                    p = m_pendingPages.erase(p);
+                else
+                {
+                    p->second.renewed = false;
+                    ++p;
+                }
             }
-            return numFetch;
+        }
+
+        /// Return number of pages marked for fetching
+        size_t pendingCount() const
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_pendingPages.size() + m_fetchingPages.size();
         }
 
     private:
+        struct Page
+        {
+            const char* data;   ///< Page data, in storage or the file mapping
+            std::unique_ptr<char[]> storage;
+            uint64_t lastUsed;  ///< Value of m_useCounter at last access
+        };
+
+        struct PendingPage
+        {
+            double priority;
+            bool renewed;    ///< Marked since last discardStaleRequests()
+        };
+
         PosType pageIndex(PosType address) const
         {
             return address/m_pageSize;
         }
 
-        std::istream& m_input;
+        /// Add page to the cache, with data held in `storage` or the file
+        /// mapping.  m_mutex must be held.
+        void insertPage(PosType pageIdx, std::unique_ptr<char[]> storage)
+        {
+            Page& page = m_pages[pageIdx];
+            assert(!page.data);
+            page.data = storage ? storage.get() : m_map + pageIdx*m_pageSize;
+            if (storage)
+                ++m_numStoredPages;
+            page.storage = std::move(storage);
+            page.lastUsed = ++m_useCounter;
+        }
+
+        /// Return true if all pages in [pagesBegin,pagesEnd) are cached
+        bool allCached(PosType pagesBegin, PosType pagesEnd) const
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (PosType pageIdx = pagesBegin; pageIdx < pagesEnd; ++pageIdx)
+            {
+                if (m_pages.find(pageIdx) == m_pages.end())
+                    return false;
+            }
+            return true;
+        }
+
+#ifndef _WIN32
+        /// Return whether all OS pages of each page in [pagesBegin,pagesEnd)
+        /// of the file mapping are in memory, with a single mincore() call.
+        /// Doesn't require m_mutex.
+        std::vector<bool> residentPages(PosType pagesBegin, PosType pagesEnd) const
+        {
+            std::vector<bool> resident(pagesEnd - pagesBegin, false);
+            PosType begin = pagesBegin*m_pageSize;
+            PosType end = std::min(pagesEnd*m_pageSize, m_fileSize);
+            PosType osBegin = begin - begin % m_osPageSize;
+            PosType numOsPages = (end - osBegin + m_osPageSize - 1)/m_osPageSize;
+#ifdef __APPLE__
+            std::vector<char> residency(numOsPages);
+#else
+            std::vector<unsigned char> residency(numOsPages);
+#endif
+            if (mincore(const_cast<char*>(m_map) + osBegin, end - osBegin, residency.data()) != 0)
+                return resident;
+            for (PosType pageIdx = pagesBegin; pageIdx < pagesEnd; ++pageIdx)
+            {
+                PosType pageBegin = pageIdx*m_pageSize;
+                PosType pageEnd = std::min(pageBegin + m_pageSize, end);
+                bool allResident = true;
+                for (PosType i = (pageBegin - osBegin)/m_osPageSize;
+                     i*m_osPageSize + osBegin < pageEnd; ++i)
+                {
+                    if (!(residency[i] & 1))
+                    {
+                        allResident = false;
+                        break;
+                    }
+                }
+                resident[pageIdx - pagesBegin] = allResident;
+            }
+            return resident;
+        }
+#else
+        std::vector<bool> residentPages(PosType /*pagesBegin*/, PosType /*pagesEnd*/) const
+        {
+            return std::vector<bool>();
+        }
+#endif
+
+        /// Evict least recently used pages until the cache fits within
+        /// m_maxSize.  m_mutex must be held.
+        ///
+        /// Pages with owned storage and pages of the file mapping are
+        /// limited separately, since only the former use memory of the
+        /// cache's own.
+        void evictPages()
+        {
+            size_t maxPages = std::max<PosType>(1, m_maxSize/m_pageSize);
+            size_t numMapped = m_pages.size() - m_numStoredPages;
+            if (m_numStoredPages > maxPages)
+                evictPages(true, m_numStoredPages - maxPages);
+            if (numMapped > maxPages)
+                evictPages(false, numMapped - maxPages);
+        }
+
+        /// Evict the `numEvict` least recently used pages which own their
+        /// storage if `stored` is true, or which are in the file mapping
+        /// otherwise.  m_mutex must be held.
+        void evictPages(bool stored, size_t numEvict)
+        {
+            typedef std::pair<uint64_t, PosType> PageUse;
+            std::vector<PageUse> pageUses;
+            pageUses.reserve(m_pages.size());
+            for (auto p = m_pages.begin(); p != m_pages.end(); ++p)
+            {
+                if ((bool)p->second.storage == stored)
+                    pageUses.push_back(PageUse(p->second.lastUsed, p->first));
+            }
+            std::nth_element(pageUses.begin(), pageUses.begin() + numEvict, pageUses.end());
+            for (size_t i = 0; i < numEvict; ++i)
+                m_pages.erase(pageUses[i].second);
+            if (stored)
+                m_numStoredPages -= numEvict;
+        }
+
+        /// Maximum number of pages read with a single seek
+        static const PosType maxRunLength = 32;
+
+        void fetchLoop(std::function<void()> pagesFetched)
+        {
+            // Fetch a few pages at a time, so that new requests with higher
+            // priority are serviced soon after they arrive
+            const size_t batchSize = 4;
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (true)
+            {
+                m_fetchRequested.wait(lock, [this]() { return m_stopFetch || !m_pendingPages.empty(); });
+                if (m_stopFetch)
+                    return;
+                lock.unlock();
+                if (fetchNow(batchSize) > 0 && pagesFetched)
+                    pagesFetched();
+                lock.lock();
+            }
+        }
+
+        std::istream* m_input;  ///< Input stream, or null for mapped files
+        const char* m_map;      ///< File mapping, or null for streams
         PosType m_pageSize;
         PosType m_fileSize;
-        std::unordered_map<PosType, double> m_pendingPages;
-        std::unordered_map<PosType, std::unique_ptr<char[]>> m_pages;
+        PosType m_osPageSize;
+        PosType m_maxSize;
+        /// Protects the page maps, statistics and m_stopFetch
+        mutable std::mutex m_mutex;
+        /// Serializes reads from m_input
+        std::mutex m_inputMutex;
+        std::unordered_map<PosType, PendingPage> m_pendingPages;
+        /// Pages removed from m_pendingPages which are being read
+        std::unordered_set<PosType> m_fetchingPages;
+        std::unordered_map<PosType, Page> m_pages;
+        /// Number of m_pages which own their storage
+        size_t m_numStoredPages;
+        uint64_t m_useCounter;
+        uint64_t m_hits;
+        uint64_t m_misses;
+        std::condition_variable m_fetchRequested;
+        std::thread m_fetchThread;
+        bool m_stopFetch;
 };
 
 
@@ -202,6 +626,31 @@ class PageCacheReader
             return read((char*)array.get(), size*sizeof(T));
         }
 
+        /// Point `array` at `size` elements of the stream in native endian
+        /// binary form without copying, if the cache supports it.
+        /// Otherwise read them into `storage` as above and point `array`
+        /// there.
+        ///
+        /// Return true on success.
+        template<typename T>
+        bool read(const T*& array, std::unique_ptr<T[]>& storage, size_t size)
+        {
+            if (!m_bad)
+            {
+                const char* data = m_cache.data(m_offset, size*sizeof(T));
+                if (data && reinterpret_cast<uintptr_t>(data) % alignof(T) == 0)
+                {
+                    array = reinterpret_cast<const T*>(data);
+                    storage.reset();
+                    m_offset += size*sizeof(T);
+                    return true;
+                }
+            }
+            bool ok = read(storage, size);
+            array = storage.get();
+            return ok;
+        }
+
     private:
         StreamPageCache& m_cache;
         uint64_t m_initialOffset;
@@ -3,8 +3,12 @@
 
 #include <catch.hpp>
 
+#include <atomic>
+#include <chrono>
 #include <cstring>
 #include <iostream>
+#include <thread>
+#include <vector>
 
 #include "streampagecache.h"
 
@@ -45,3 +49,150 @@ TEST_CASE("Test page cache for std::istream")
     }
 }
 
+
+/// Temporary file of random bytes for the tests which follow
+struct TestFile
+{
+    std::vector<char> data;
+    std::string name;
+
+    TestFile() : data(12345), name("streampagecache_test.dat")
+    {
+        for (size_t i = 0; i < data.size(); ++i)
+            data[i] = rand() % 256;
+        std::ofstream out(name, std::ios::binary);
+        out.write(data.data(), data.size());
+    }
+};
+
+TEST_CASE_METHOD(TestFile, "Test page cache background fetching")
+{
+    std::ifstream in(name, std::ios::binary);
+    StreamPageCache cache(in, 1001);
+    std::atomic<int> batchesFetched(0);
+    cache.startBackgroundFetch([&]() { ++batchesFetched; });
+
+    // Stale requests are dropped before they can be fetched
+    cache.stopBackgroundFetch();
+    CHECK_FALSE(cache.prefetch(5010, 10));
+    cache.discardStaleRequests();
+    CHECK(cache.pendingCount() == 1);
+    cache.discardStaleRequests();
+    CHECK(cache.pendingCount() == 0);
+
+    cache.startBackgroundFetch([&]() { ++batchesFetched; });
+    std::vector<char> readData(data.size());
+    char* buf2 = readData.data();
+    CHECK_FALSE(cache.prefetch(0, data.size()));
+    for (int i = 0; i < 1000 && !cache.read(buf2, 0, data.size()); ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    CHECK(cache.read(buf2, 0, data.size()));
+    CHECK(std::memcmp(data.data(), buf2, data.size()) == 0);
+    CHECK(cache.pendingCount() == 0);
+    CHECK(batchesFetched > 0);
+}
+
+TEST_CASE_METHOD(TestFile, "Test page cache data.size() limit")
+{
+    std::ifstream in(name, std::ios::binary);
+    StreamPageCache cache(in, 1000);
+    cache.setMaxSize(3000);
+    std::vector<char> readData(data.size());
+    char* buf2 = readData.data();
+
+    // Fetch pages 0,1,2 and use page 0, so that page 1 is least recently used
+    CHECK_FALSE(cache.prefetch(0, 3000));
+    cache.fetchNow(3);
+    CHECK(cache.read(buf2, 1500, 10));
+    CHECK(cache.read(buf2, 2500, 10));
+    CHECK(cache.read(buf2, 0, 10));
+    CHECK(cache.stats().sizeBytes == 3000);
+
+    CHECK_FALSE(cache.prefetch(5000, 10));
+    cache.fetchNow(1);
+    CHECK(cache.stats().sizeBytes == 3000);
+    CHECK(cache.read(buf2, 5000, 10));
+    CHECK(std::memcmp(data.data() + 5000, buf2, 10) == 0);
+    CHECK(cache.read(buf2, 0, 10));
+    CHECK(cache.read(buf2, 2000, 10));
+    CHECK_FALSE(cache.read(buf2, 1000, 10));
+
+    StreamPageCache::Stats stats = cache.stats();
+    CHECK(stats.hits == 6);
+    CHECK(stats.misses == 1);
+}
+
+TEST_CASE_METHOD(TestFile, "Test page cache fetches adjacent pages together")
+{
+    std::ifstream in(name, std::ios::binary);
+    StreamPageCache cache(in, 1000);
+    std::vector<char> readData(data.size());
+    char* buf2 = readData.data();
+
+    // Pages 2-5 form a run which is read along with the top priority page
+    CHECK_FALSE(cache.prefetch(2000, 3000, 1));
+    CHECK_FALSE(cache.prefetch(5000, 10, 2));
+    CHECK_FALSE(cache.prefetch(9000, 10, 0));
+    CHECK(cache.fetchNow(1) == 4);
+    CHECK(cache.read(buf2, 2000, 4000));
+    CHECK(std::memcmp(data.data() + 2000, buf2, 4000) == 0);
+    CHECK(cache.pendingCount() == 1);
+
+    // Last page of the file is short
+    CHECK(cache.fetchNow(1) == 1);
+    CHECK_FALSE(cache.prefetch(12000, data.size() - 12000));
+    CHECK(cache.fetchNow(1) == 1);
+    CHECK(cache.read(buf2, 9000, 10));
+    CHECK(std::memcmp(data.data() + 9000, buf2, 10) == 0);
+    CHECK(cache.read(buf2, 12000, data.size() - 12000));
+    CHECK(std::memcmp(data.data() + 12000, buf2, data.size() - 12000) == 0);
+}
+
+#ifndef _WIN32
+TEST_CASE_METHOD(TestFile, "Test page cache for memory mapped file")
+{
+    StreamPageCache cache(name, 1001);
+    std::vector<char> readData(data.size());
+    char* buf2 = readData.data();
+    for (size_t i = 0; i < data.size()-3; i += 7)
+    {
+        if (!cache.prefetch(i, 3))
+            cache.fetchNow(2);
+        CHECK(cache.read(buf2, i, 3));
+        CHECK(std::memcmp(data.data() + i, buf2, 3) == 0);
+    }
+
+    // Cached data is accessed in place
+    if (!cache.prefetch(0, data.size()))
+        cache.fetchNow(100);
+    const char* mapped = cache.data(2000, 3000);
+    REQUIRE(mapped != 0);
+    CHECK(std::memcmp(data.data() + 2000, mapped, 3000) == 0);
+    // Mapped pages don't use storage of the cache
+    CHECK(cache.stats().sizeBytes == 0);
+    CHECK(cache.stats().mappedBytes > 0);
+
+    PageCacheReader reader(cache, 4);
+    const float* array = 0;
+    std::unique_ptr<float[]> storage;
+    CHECK(reader.read(array, storage, 100));
+    CHECK(!storage);
+    CHECK(std::memcmp(data.data() + 4, array, 100*sizeof(float)) == 0);
+}
+#endif
+
+TEST_CASE_METHOD(TestFile, "Test page cache reader copies from streams")
+{
+    std::ifstream in(name, std::ios::binary);
+    StreamPageCache cache(in, 1001);
+    CHECK_FALSE(cache.prefetch(0, data.size()));
+    cache.fetchNow(100);
+    CHECK(cache.data(0, 10) == 0);
+
+    PageCacheReader reader(cache, 4);
+    const float* array = 0;
+    std::unique_ptr<float[]> storage;
+    CHECK(reader.read(array, storage, 100));
+    CHECK(array == storage.get());
+    CHECK(std::memcmp(data.data() + 4, array, 100*sizeof(float)) == 0);
+}
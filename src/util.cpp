@@ -19,21 +19,65 @@
 #   include <signal.h>
 #endif
 
+#include <algorithm>
 #include <cfloat>
 
 #include "tinyformat.h"
 
-size_t EllipticalDist::findNearest(const V3d& offset, const V3f* points,
-                                   size_t nPoints, double* distance) const
+//------------------------------------------------------------------------------
+// Nearest point search for EllipticalDist
+//
+// The squared elliptical distance of a vector v from the origin is
+//
+//   r2 = |v - a*axis|^2 + scale^2*a^2,    where a = axis.dot(v)
+//
+// which is the distance perpendicular to the axis plus the scaled distance
+// along it.  The SIMD kernels compute this in single precision for several
+// points at once, tracking the minimum and its index separately in each
+// lane.  The lanes are reduced to a single argmin at the end, breaking ties
+// in favour of the lowest index as for the sequential loop.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#   define DISPLAZ_HAVE_SSE2
+#   include <emmintrin.h>
+#endif
+
+#if defined(DISPLAZ_HAVE_SSE2) && defined(__GNUC__)
+    // AVX2 is compiled separately and selected at runtime
+#   define DISPLAZ_HAVE_AVX2
+#   define DISPLAZ_AVX2_TARGET __attribute__((target("avx2")))
+#   include <immintrin.h>
+static bool cpuHasAvx2() { return __builtin_cpu_supports("avx2"); }
+#elif defined(DISPLAZ_HAVE_SSE2) && defined(__AVX2__)
+#   define DISPLAZ_HAVE_AVX2
+#   define DISPLAZ_AVX2_TARGET
+#   include <immintrin.h>
+static bool cpuHasAvx2() { return true; }
+#endif
+
+static_assert(sizeof(V3f) == 3*sizeof(float), "V3f must be three packed floats");
+
+namespace {
+
+/// Single precision search parameters, relative to the point offset
+struct NearestParams
 {
-    V3f offsetOrigin = V3f(m_origin - offset);
-    const double f = m_scale*m_scale - 1;
+    float ox, oy, oz;  ///< Origin
+    float ax, ay, az;  ///< Normalized axis
+    float s2;          ///< Squared axial scaling
+};
+
+/// Find the nearest point with the sequential double precision algorithm
+size_t findNearestDouble(const V3f& offsetOrigin, const V3d& axis, double scale,
+                         const V3f* points, size_t nPoints, double& nearestDist2)
+{
+    const double f = scale*scale - 1;
     size_t nearestIdx = -1;
-    double nearestDist2 = DBL_MAX;
+    nearestDist2 = DBL_MAX;
     for(size_t i = 0; i < nPoints; ++i)
     {
         const V3f v = points[i] - offsetOrigin; // vector from ray origin to point
-        const double a = m_axis.dot(v); // distance along ray to point of closest approach to test point
+        const double a = axis.dot(v); // distance along ray to point of closest approach to test point
         const double r2 = v.length2() + f*a*a;
 
         if(r2 < nearestDist2)
@@ -43,12 +87,233 @@ size_t EllipticalDist::findNearest(const V3d& offset, const V3f* points,
             nearestIdx = i;
         }
     }
+    return nearestIdx;
+}
+
+#ifdef DISPLAZ_HAVE_SSE2
+
+/// Search points [begin,nPoints) one at a time in single precision,
+/// updating the nearest point if any is strictly nearer.
+void findNearestTail(const NearestParams& p, const V3f* points, size_t begin,
+                     size_t nPoints, float& nearestDist2, size_t& nearestIdx)
+{
+    for (size_t i = begin; i < nPoints; ++i)
+    {
+        float vx = points[i].x - p.ox, vy = points[i].y - p.oy, vz = points[i].z - p.oz;
+        float a = vx*p.ax + vy*p.ay + vz*p.az;
+        float px = vx - a*p.ax, py = vy - a*p.ay, pz = vz - a*p.az;
+        float r2 = px*px + py*py + pz*pz + p.s2*a*a;
+        if (r2 < nearestDist2)
+        {
+            nearestDist2 = r2;
+            nearestIdx = i;
+        }
+    }
+}
+
+/// Reduce per-lane minima and their indices to the overall argmin
+void reduceLanes(const float* dist2, const int32_t* idx, int nLanes,
+                 float& nearestDist2, size_t& nearestIdx)
+{
+    for (int j = 0; j < nLanes; ++j)
+    {
+        if (dist2[j] < nearestDist2 ||
+            (dist2[j] == nearestDist2 && nearestIdx != size_t(-1) &&
+             (size_t)idx[j] < nearestIdx))
+        {
+            nearestDist2 = dist2[j];
+            nearestIdx = idx[j];
+        }
+    }
+}
+
+/// Transpose four packed V3f (x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3) into
+/// vectors of x, y and z components
+#define DISPLAZ_TRANSPOSE_XYZ(shuffle, m03, m14, m25, x, y, z)          \
+    {                                                                   \
+        auto xy = shuffle(m14, m25, _MM_SHUFFLE(2,1,3,2));              \
+        auto yz = shuffle(m03, m14, _MM_SHUFFLE(1,0,2,1));              \
+        x = shuffle(m03, xy, _MM_SHUFFLE(2,0,3,0));                     \
+        y = shuffle(yz, xy, _MM_SHUFFLE(3,1,2,0));                      \
+        z = shuffle(yz, m25, _MM_SHUFFLE(3,0,3,1));                     \
+    }
+
+/// Find nearest of `nPoints` (less than 2^31) points, four at a time
+void findNearestSse2(const NearestParams& p, const V3f* points, size_t nPoints,
+                     float& nearestDist2, size_t& nearestIdx)
+{
+    const float* data = &points[0].x;
+    const __m128 ox = _mm_set1_ps(p.ox), oy = _mm_set1_ps(p.oy), oz = _mm_set1_ps(p.oz);
+    const __m128 ax = _mm_set1_ps(p.ax), ay = _mm_set1_ps(p.ay), az = _mm_set1_ps(p.az);
+    const __m128 s2 = _mm_set1_ps(p.s2);
+    __m128 minDist2 = _mm_set1_ps(FLT_MAX);
+    __m128i minIdx = _mm_set1_epi32(-1);
+    __m128i idx = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i step = _mm_set1_epi32(4);
+    size_t nBlocks = nPoints/4;
+    for (size_t b = 0; b < nBlocks; ++b, data += 12)
+    {
+        __m128 x, y, z;
+        __m128 m03 = _mm_loadu_ps(data), m14 = _mm_loadu_ps(data + 4),
+               m25 = _mm_loadu_ps(data + 8);
+        DISPLAZ_TRANSPOSE_XYZ(_mm_shuffle_ps, m03, m14, m25, x, y, z);
+        __m128 vx = _mm_sub_ps(x, ox), vy = _mm_sub_ps(y, oy), vz = _mm_sub_ps(z, oz);
+        __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, ax), _mm_mul_ps(vy, ay)),
+                              _mm_mul_ps(vz, az));
+        __m128 px = _mm_sub_ps(vx, _mm_mul_ps(a, ax));
+        __m128 py = _mm_sub_ps(vy, _mm_mul_ps(a, ay));
+        __m128 pz = _mm_sub_ps(vz, _mm_mul_ps(a, az));
+        __m128 r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, px), _mm_mul_ps(py, py)),
+                               _mm_add_ps(_mm_mul_ps(pz, pz), _mm_mul_ps(s2, _mm_mul_ps(a, a))));
+        __m128 nearer = _mm_cmplt_ps(r2, minDist2);
+        minDist2 = _mm_or_ps(_mm_and_ps(nearer, r2), _mm_andnot_ps(nearer, minDist2));
+        __m128i nearerI = _mm_castps_si128(nearer);
+        minIdx = _mm_or_si128(_mm_and_si128(nearerI, idx), _mm_andnot_si128(nearerI, minIdx));
+        idx = _mm_add_epi32(idx, step);
+    }
+    alignas(16) float laneDist2[4];
+    alignas(16) int32_t laneIdx[4];
+    _mm_store_ps(laneDist2, minDist2);
+    _mm_store_si128((__m128i*)laneIdx, minIdx);
+    nearestDist2 = FLT_MAX;
+    nearestIdx = -1;
+    reduceLanes(laneDist2, laneIdx, 4, nearestDist2, nearestIdx);
+    findNearestTail(p, points, nBlocks*4, nPoints, nearestDist2, nearestIdx);
+}
+
+#endif // DISPLAZ_HAVE_SSE2
+
+#ifdef DISPLAZ_HAVE_AVX2
+
+/// Find nearest of `nPoints` (less than 2^31) points, eight at a time
+DISPLAZ_AVX2_TARGET
+void findNearestAvx2(const NearestParams& p, const V3f* points, size_t nPoints,
+                     float& nearestDist2, size_t& nearestIdx)
+{
+    const float* data = &points[0].x;
+    const __m256 ox = _mm256_set1_ps(p.ox), oy = _mm256_set1_ps(p.oy), oz = _mm256_set1_ps(p.oz);
+    const __m256 ax = _mm256_set1_ps(p.ax), ay = _mm256_set1_ps(p.ay), az = _mm256_set1_ps(p.az);
+    const __m256 s2 = _mm256_set1_ps(p.s2);
+    __m256 minDist2 = _mm256_set1_ps(FLT_MAX);
+    __m256i minIdx = _mm256_set1_epi32(-1);
+    __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i step = _mm256_set1_epi32(8);
+    size_t nBlocks = nPoints/8;
+    for (size_t b = 0; b < nBlocks; ++b, data += 24)
+    {
+        // Points 0-3 in the low half of each register and 4-7 in the high
+        // half, so the SSE transpose works within each half.
+        __m256 x, y, z;
+        __m256 m03 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(data)),
+                                          _mm_loadu_ps(data + 12), 1);
+        __m256 m14 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(data + 4)),
+                                          _mm_loadu_ps(data + 16), 1);
+        __m256 m25 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(data + 8)),
+                                          _mm_loadu_ps(data + 20), 1);
+        DISPLAZ_TRANSPOSE_XYZ(_mm256_shuffle_ps, m03, m14, m25, x, y, z);
+        __m256 vx = _mm256_sub_ps(x, ox), vy = _mm256_sub_ps(y, oy), vz = _mm256_sub_ps(z, oz);
+        __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(vx, ax), _mm256_mul_ps(vy, ay)),
+                                 _mm256_mul_ps(vz, az));
+        __m256 px = _mm256_sub_ps(vx, _mm256_mul_ps(a, ax));
+        __m256 py = _mm256_sub_ps(vy, _mm256_mul_ps(a, ay));
+        __m256 pz = _mm256_sub_ps(vz, _mm256_mul_ps(a, az));
+        __m256 r2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px, px), _mm256_mul_ps(py, py)),
+                                  _mm256_add_ps(_mm256_mul_ps(pz, pz),
+                                                _mm256_mul_ps(s2, _mm256_mul_ps(a, a))));
+        __m256 nearer = _mm256_cmp_ps(r2, minDist2, _CMP_LT_OQ);
+        minDist2 = _mm256_blendv_ps(minDist2, r2, nearer);
+        minIdx = _mm256_blendv_epi8(minIdx, idx, _mm256_castps_si256(nearer));
+        idx = _mm256_add_epi32(idx, step);
+    }
+    alignas(32) float laneDist2[8];
+    alignas(32) int32_t laneIdx[8];
+    _mm256_store_ps(laneDist2, minDist2);
+    _mm256_store_si256((__m256i*)laneIdx, minIdx);
+    nearestDist2 = FLT_MAX;
+    nearestIdx = -1;
+    reduceLanes(laneDist2, laneIdx, 8, nearestDist2, nearestIdx);
+    findNearestTail(p, points, nBlocks*8, nPoints, nearestDist2, nearestIdx);
+}
+
+#endif // DISPLAZ_HAVE_AVX2
+
+#ifdef DISPLAZ_HAVE_SSE2
+
+typedef void (*NearestKernel)(const NearestParams&, const V3f*, size_t, float&, size_t&);
+
+NearestKernel nearestKernel()
+{
+#ifdef DISPLAZ_HAVE_AVX2
+    static const NearestKernel kernel = cpuHasAvx2() ? findNearestAvx2 : findNearestSse2;
+    return kernel;
+#else
+    return findNearestSse2;
+#endif
+}
+
+#endif
+
+} // namespace
+
+
+const char* EllipticalDist::findNearestKernelName()
+{
+#if defined(DISPLAZ_HAVE_AVX2)
+    return nearestKernel() == findNearestAvx2 ? "avx2" : "sse2";
+#elif defined(DISPLAZ_HAVE_SSE2)
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+
+size_t EllipticalDist::findNearest(const V3d& offset, const V3f* points,
+                                   size_t nPoints, double* distance) const
+{
+    V3f offsetOrigin = V3f(m_origin - offset);
+    size_t nearestIdx = -1;
+#ifdef DISPLAZ_HAVE_SSE2
+    NearestParams params = {offsetOrigin.x, offsetOrigin.y, offsetOrigin.z,
+                            (float)m_axis.x, (float)m_axis.y, (float)m_axis.z,
+                            (float)(m_scale*m_scale)};
+    NearestKernel kernel = nearestKernel();
+    // Lane indices are 32 bit, so search in chunks
+    const size_t maxChunkSize = size_t(1) << 30;
+    float nearestDist2f = FLT_MAX;
+    for (size_t begin = 0; begin < nPoints; begin += maxChunkSize)
+    {
+        size_t chunkIdx = -1;
+        float chunkDist2 = FLT_MAX;
+        kernel(params, points + begin, std::min(maxChunkSize, nPoints - begin),
+               chunkDist2, chunkIdx);
+        if (chunkIdx != size_t(-1) && chunkDist2 < nearestDist2f)
+        {
+            nearestDist2f = chunkDist2;
+            nearestIdx = begin + chunkIdx;
+        }
+    }
+#endif
+    double nearestDist2 = DBL_MAX;
+    if (nearestIdx == size_t(-1))
+    {
+        // No SIMD, or every distance overflowed single precision
+        nearestIdx = findNearestDouble(offsetOrigin, m_axis, m_scale, points,
+                                       nPoints, nearestDist2);
+    }
+    else if (distance)
+    {
+        // Report the distance in double precision
+        const V3f v = points[nearestIdx] - offsetOrigin;
+        const double a = m_axis.dot(v);
+        nearestDist2 = v.length2() + (m_scale*m_scale - 1)*a*a;
+    }
     if(distance)
     {
         if(nPoints == 0)
             *distance = DBL_MAX;
         else
-            *distance = sqrt(nearestDist2);
+            *distance = sqrt(std::max(0.0, nearestDist2));
     }
     return nearestIdx;
 }
@@ -146,6 +411,230 @@ V3d polygonNormal(const std::vector<float>& verts,
 }
 
 
+/// Mix bits of `x` to produce a well distributed pseudo random hash
+/// (the splitmix64 finalizer)
+static inline uint64_t hashIndex(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+
+/// Spread the lower 10 bits of x so that there's two zero bits between each
+/// bit, for computing 3D Morton codes.
+static inline uint32_t spreadBits3(uint32_t x)
+{
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x <<  8)) & 0x0300f00f;
+    x = (x | (x <<  4)) & 0x030c30c3;
+    x = (x | (x <<  2)) & 0x09249249;
+    return x;
+}
+
+
+void stratifiedOrder(size_t* inds, size_t n, const V3f* P, size_t numOrdered)
+{
+    numOrdered = std::min(numOrdered, n);
+    if (numOrdered == 0)
+        return;
+    // For large inputs, restrict attention to a pseudo random pool of
+    // candidates to bound the memory and time required.
+    size_t poolSize = (numOrdered < n) ? std::min(n, 8*numOrdered) : n;
+    if (poolSize < n)
+    {
+        std::nth_element(inds, inds + poolSize, inds + n,
+                         [](size_t a, size_t b) { return hashIndex(a) < hashIndex(b); });
+    }
+    n = poolSize;
+
+    Box3f bbox;
+    for (size_t i = 0; i < n; ++i)
+        bbox.extendBy(P[inds[i]]);
+    V3f diag = bbox.size();
+    float width = std::max(std::max(diag.x, diag.y), diag.z);
+    // Morton codes of cubic grid cells at the finest level
+    const int numLevels = 10;
+    const float cellScale = (width > 0) ? (1 << numLevels)/width : 0;
+    const uint32_t maxCell = (1 << numLevels) - 1;
+    struct OrderKey
+    {
+        uint32_t cell;
+        uint32_t level;
+        uint64_t hash;
+        size_t index;
+    };
+    std::vector<OrderKey> keys(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        V3f p = (P[inds[i]] - bbox.min) * cellScale;
+        uint32_t x = std::min(maxCell, (uint32_t)p.x);
+        uint32_t y = std::min(maxCell, (uint32_t)p.y);
+        uint32_t z = std::min(maxCell, (uint32_t)p.z);
+        OrderKey& k = keys[i];
+        k.cell = spreadBits3(x) | (spreadBits3(y) << 1) | (spreadBits3(z) << 2);
+        k.level = numLevels + 1;
+        k.hash = hashIndex(inds[i]);
+        k.index = inds[i];
+    }
+    std::sort(keys.begin(), keys.end(), [](const OrderKey& a, const OrderKey& b)
+              { return a.cell < b.cell || (a.cell == b.cell && a.hash < b.hash); });
+    // Cells at each level are contiguous in Morton order.  The point with
+    // the smallest hash represents the cell, so a point's level is the
+    // coarsest level at which it represents a cell.
+    for (int level = 0; level <= numLevels; ++level)
+    {
+        int shift = 3*(numLevels - level);
+        for (size_t begin = 0; begin < n;)
+        {
+            uint32_t cell = keys[begin].cell >> shift;
+            size_t best = begin;
+            size_t end = begin + 1;
+            for (; end < n && (keys[end].cell >> shift) == cell; ++end)
+            {
+                if (keys[end].hash < keys[best].hash)
+                    best = end;
+            }
+            if (keys[best].level > (uint32_t)level)
+                keys[best].level = level;
+            begin = end;
+        }
+    }
+    // Order by level, and pseudo randomly within a level so that a partial
+    // level is still spread evenly.
+    auto levelOrder = [](const OrderKey& a, const OrderKey& b)
+    {
+        return a.level < b.level || (a.level == b.level && a.hash < b.hash);
+    };
+    if (numOrdered < n)
+        std::partial_sort(keys.begin(), keys.begin() + numOrdered, keys.end(), levelOrder);
+    else
+        std::sort(keys.begin(), keys.end(), levelOrder);
+    for (size_t i = 0; i < n; ++i)
+        inds[i] = keys[i].index;
+}
+
+
+//------------------------------------------------------------------------------
+ThreadPool::ThreadPool(unsigned int numThreads)
+{
+    for (unsigned int i = 0; i < numThreads; ++i)
+        m_threads.emplace_back(&ThreadPool::workerLoop, this);
+}
+
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_taskQueued.notify_all();
+    for (auto& t : m_threads)
+        t.join();
+}
+
+
+void ThreadPool::run(std::function<void()> task)
+{
+    if (m_threads.empty())
+    {
+        task();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tasks.push_back(std::move(task));
+    }
+    m_taskQueued.notify_one();
+}
+
+
+void ThreadPool::wait()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_tasksFinished.wait(lock, [&]() { return m_tasks.empty() && m_numRunning == 0; });
+}
+
+
+void ThreadPool::workerLoop()
+{
+    while (true)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_taskQueued.wait(lock, [&]() { return m_stop || !m_tasks.empty(); });
+            if (m_tasks.empty())
+                return;
+            task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+            ++m_numRunning;
+        }
+        task();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        --m_numRunning;
+        if (m_tasks.empty() && m_numRunning == 0)
+            m_tasksFinished.notify_all();
+    }
+}
+
+
+void ThreadPool::parallelFor(size_t begin, size_t end,
+                             const std::function<void(size_t)>& func)
+{
+    if (end <= begin)
+        return;
+    // Helper tasks share the index counter with the caller.  A helper which
+    // only starts once the caller has closed the batch returns without
+    // touching `func`, so the caller never waits on a worker which is busy
+    // elsewhere (for example, with the task this call is nested in).
+    struct Batch
+    {
+        std::atomic<size_t> next;
+        std::mutex mutex;
+        std::condition_variable finished;
+        int numActive = 0;
+        bool closed = false;
+    };
+    auto batch = std::make_shared<Batch>();
+    batch->next = begin;
+    const std::function<void(size_t)>* funcPtr = &func;
+    size_t numHelpers = std::min<size_t>(end - begin - 1, m_threads.size());
+    for (size_t i = 0; i < numHelpers; ++i)
+    {
+        run([batch, end, funcPtr]()
+        {
+            {
+                std::lock_guard<std::mutex> lock(batch->mutex);
+                if (batch->closed)
+                    return;
+                ++batch->numActive;
+            }
+            for (size_t j = batch->next++; j < end; j = batch->next++)
+                (*funcPtr)(j);
+            std::lock_guard<std::mutex> lock(batch->mutex);
+            if (--batch->numActive == 0)
+                batch->finished.notify_all();
+        });
+    }
+    for (size_t j = batch->next++; j < end; j = batch->next++)
+        func(j);
+    std::unique_lock<std::mutex> lock(batch->mutex);
+    batch->closed = true;
+    batch->finished.wait(lock, [&]() { return batch->numActive == 0; });
+}
+
+
+ThreadPool& ThreadPool::global()
+{
+    static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+    return pool;
+}
+
+
 //------------------------------------------------------------------------------
 
 void milliSleep(int msecs)
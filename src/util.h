@@ -4,11 +4,17 @@
 #ifndef UTIL_H_INCLUDED
 #define UTIL_H_INCLUDED
 
+#include <atomic>
 #include <cmath>
+#include <condition_variable>
 #include <cstdio>
+#include <deque>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
 #ifdef __clang__
@@ -84,9 +90,16 @@ class EllipticalDist
         ///
         /// Also return the distance to the nearest point if the input distance
         /// parameter is non-null.
+        ///
+        /// The search is vectorized in single precision where possible, so
+        /// points with nearly equal distances may be ranked differently from
+        /// an exact calculation.
         size_t findNearest(const V3d& offset, const V3f* points,
                            size_t nPoints, double* distance = 0) const;
 
+        /// Return name of the SIMD instruction set used by findNearest()
+        static const char* findNearestKernelName();
+
         /// Return lower bound on elliptical distance to any point in `box`
         double boundNearest(const Box3d& box) const;
 
@@ -159,6 +172,93 @@ void multi_partition(IterT first, IterT last, ClassFuncT classFunc,
 }
 
 
+/// Reorder points so that every prefix is a spatially stratified sample.
+///
+/// On return, the first `numOrdered` elements of `inds[0..n)` are ordered
+/// such that any prefix `P[inds[0..k)]` covers the region occupied by the
+/// points approximately uniformly, avoiding the clumps and holes of a purely
+/// random order.  This uses a multi resolution grid ordering: the first
+/// points are one per cell of a coarse grid, followed by one per cell of
+/// successively finer grids.  The remaining elements are left in unspecified
+/// order.
+///
+/// The ordering depends only on the point positions and the values in
+/// `inds`, so it's deterministic and may be computed for disjoint ranges in
+/// parallel.
+void stratifiedOrder(size_t* inds, size_t n, const V3f* P, size_t numOrdered);
+
+
+/// Pool of persistent worker threads
+///
+/// Work which is done every frame is too short lived to pay for starting
+/// threads each time, so it's handed to workers which wait on a condition
+/// variable between tasks.
+class ThreadPool
+{
+    public:
+        /// Start `numThreads` workers.  With no workers, tasks run on the
+        /// calling thread.
+        explicit ThreadPool(unsigned int numThreads);
+        /// Finish the queued tasks and stop the workers
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        unsigned int numThreads() const { return (unsigned int)m_threads.size(); }
+
+        /// Queue `task` to be run by the next free worker
+        void run(std::function<void()> task);
+
+        /// Wait until all queued tasks have finished
+        void wait();
+
+        /// Call `func(i)` for each `i` in `[begin,end)`, sharing the calls
+        /// between the calling thread and the workers.
+        ///
+        /// The calling thread takes any calls the workers are too busy to
+        /// start, so this may be nested inside a task of the same pool.
+        void parallelFor(size_t begin, size_t end,
+                         const std::function<void(size_t)>& func);
+
+        /// Pool shared by parallelFor(), with a worker for each hardware
+        /// thread other than the caller
+        static ThreadPool& global();
+
+    private:
+        void workerLoop();
+
+        std::vector<std::thread> m_threads;
+        std::mutex m_mutex;
+        std::condition_variable m_taskQueued;
+        std::condition_variable m_tasksFinished;
+        std::deque<std::function<void()>> m_tasks;
+        size_t m_numRunning = 0;
+        bool m_stop = false;
+};
+
+
+/// Call `func(i)` for each `i` in `[begin,end)`, distributing the calls over
+/// the available hardware threads.
+///
+/// `func` must be safe to call concurrently for different values of `i`.
+template<typename FuncT>
+void parallelFor(size_t begin, size_t end, const FuncT& func)
+{
+    ThreadPool::global().parallelFor(begin, end, std::cref(func));
+}
+
+
+/// Atomically replace `value` with `x` if `x` is smaller
+template<typename T>
+void atomicMin(std::atomic<T>& value, T x)
+{
+    T current = value.load();
+    while (x < current && !value.compare_exchange_weak(current, x))
+    { }
+}
+
+
 /// Return true if box b1 contains box b2
 template<typename T>
 bool contains(const Imath::Box<T> b1, const Imath::Box<T> b2)
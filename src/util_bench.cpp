@@ -0,0 +1,85 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+// Microbenchmarks for performance sensitive utility functions
+//
+// Usage: util_bench [numPoints] [numRepeats]
+
+#include <cfloat>
+#include <chrono>
+#include <cstdlib>
+
+#include "util.h"
+
+
+/// Sequential double precision nearest point search, for comparison with
+/// EllipticalDist::findNearest()
+static size_t findNearestReference(const EllipticalDist& distFunc, const V3d& offset,
+                                   const V3f* points, size_t nPoints)
+{
+    V3f offsetOrigin = V3f(distFunc.origin() - offset);
+    const double f = distFunc.scale()*distFunc.scale() - 1;
+    size_t nearestIdx = -1;
+    double nearestDist2 = DBL_MAX;
+    for (size_t i = 0; i < nPoints; ++i)
+    {
+        const V3f v = points[i] - offsetOrigin;
+        const double a = distFunc.axis().dot(v);
+        const double r2 = v.length2() + f*a*a;
+        if (r2 < nearestDist2)
+        {
+            nearestDist2 = r2;
+            nearestIdx = i;
+        }
+    }
+    return nearestIdx;
+}
+
+
+/// Return time per point in nanoseconds for `numRepeats` calls of
+/// `searchFunc`
+template<typename SearchFuncT>
+static double timePerPoint(size_t numPoints, int numRepeats, size_t& result,
+                           SearchFuncT searchFunc)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < numRepeats; ++i)
+        result += searchFunc();
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    return ns/(double(numPoints)*numRepeats);
+}
+
+
+int main(int argc, char* argv[])
+{
+    // Default to the size of a full octree leaf
+    size_t numPoints = (argc > 1) ? atol(argv[1]) : 100000;
+    int numRepeats = (argc > 2) ? atoi(argv[2]) : 200;
+
+    std::vector<V3f> P(numPoints);
+    uint32_t seed = 1;
+    auto rand01 = [&]() { seed = seed*1664525 + 1013904223; return (seed >> 8)/float(1 << 24); };
+    for (auto& p : P)
+        p = V3f(200*rand01() - 100, 200*rand01() - 100, 20*rand01());
+    const V3d offset(500000, 6000000, 100);
+    // Typical picking ray, with the axial distance scaled down
+    EllipticalDist distFunc(offset + V3d(10, 20, 500), V3d(0.1, 0.2, -1), 0.01);
+
+    size_t checksum = 0;
+    double refTime = timePerPoint(numPoints, numRepeats, checksum, [&]()
+        { return findNearestReference(distFunc, offset, P.data(), numPoints); });
+    double simdTime = timePerPoint(numPoints, numRepeats, checksum, [&]()
+        { return distFunc.findNearest(offset, P.data(), numPoints); });
+
+    size_t refIdx = findNearestReference(distFunc, offset, P.data(), numPoints);
+    size_t simdIdx = distFunc.findNearest(offset, P.data(), numPoints);
+
+    tfm::printf("EllipticalDist::findNearest, %d points x %d repeats\n", numPoints, numRepeats);
+    tfm::printf("  reference (double) : %7.3f ns/point\n", refTime);
+    tfm::printf("  %-18s : %7.3f ns/point  (%.1fx)\n", distFunc.findNearestKernelName(),
+                simdTime, refTime/simdTime);
+    tfm::printf("  nearest index %s (reference %d, kernel %d)  [checksum %d]\n",
+                (refIdx == simdIdx) ? "matches" : "differs", refIdx, simdIdx, checksum);
+    return 0;
+}
@@ -3,6 +3,8 @@
 
 #include <catch.hpp>
 
+#include <cfloat>
+
 #include "util.h"
 
 // gcc 4.6 and 4.7 warns/suggests parentheses around == comparison
@@ -160,3 +162,123 @@ TEST_CASE("Anisotropic EllipticalDist bound tests")
     // degenerate box in general position
     CHECK(fabs(dist.boundNearest(Box3d(V3d(1,2,3), V3d(1,2,3))) - sqrt(0.1*0.1*1*1 + 2*2 + 3*3)) < 1e-15);
 }
+
+
+TEST_CASE("EllipticalDist nearest point agrees with exact search")
+{
+    // Pseudo random points, with sizes chosen to exercise the SIMD tails
+    std::vector<V3f> P;
+    uint32_t seed = 1;
+    auto rand01 = [&]() { seed = seed*1664525 + 1013904223; return (seed >> 8)/float(1 << 24); };
+    for (int i = 0; i < 10007; ++i)
+        P.push_back(V3f(200*rand01() - 100, 200*rand01() - 100, 200*rand01() - 100));
+    const V3d offset(1000, -2000, 50);
+    size_t sizes[] = {0, 1, 3, 7, 8, 9, 17, 1000, P.size()};
+    double scales[] = {1, 0.1, 0.001};
+    for (double scale : scales)
+    for (size_t n : sizes)
+    {
+        EllipticalDist dist(offset + V3d(3, -7, 11), V3d(1, 2, -0.5), scale);
+        double nearestDist = -1;
+        size_t idx = dist.findNearest(offset, P.data(), n, &nearestDist);
+        // Exact search
+        double exactDist = DBL_MAX;
+        for (size_t i = 0; i < n; ++i)
+        {
+            V3d v = V3d(P[i]) + offset - dist.origin();
+            double a = v.dot(dist.axis());
+            exactDist = std::min(exactDist, sqrt(v.length2() + (scale*scale - 1)*a*a));
+        }
+        if (n == 0)
+        {
+            CHECK(idx == size_t(-1));
+            CHECK(nearestDist == DBL_MAX);
+            continue;
+        }
+        REQUIRE(idx < n);
+        // Single precision can only confuse points at nearly equal distances
+        CHECK(nearestDist >= exactDist - 1e-3);
+        CHECK(nearestDist <= exactDist + 1e-3);
+    }
+}
+
+
+TEST_CASE("Stratified point ordering")
+{
+    // Regular grid of points in the plane
+    const int N = 64;
+    std::vector<V3f> P;
+    for (int j = 0; j < N; ++j)
+        for (int i = 0; i < N; ++i)
+            P.push_back(V3f(i, j, 0));
+    std::vector<size_t> inds(P.size());
+    for (size_t i = 0; i < inds.size(); ++i)
+        inds[i] = i;
+    std::vector<size_t> inds2(inds.rbegin(), inds.rend());
+
+    stratifiedOrder(inds.data(), inds.size(), P.data(), inds.size());
+
+    // Result is a permutation
+    std::vector<size_t> sortedInds = inds;
+    std::sort(sortedInds.begin(), sortedInds.end());
+    for (size_t i = 0; i < sortedInds.size(); ++i)
+        CHECK(sortedInds[i] == i);
+
+    // Result doesn't depend on input order
+    stratifiedOrder(inds2.data(), inds2.size(), P.data(), inds2.size());
+    CHECK(inds == inds2);
+
+    // Prefix of length 16 has one point in each cell of a 4x4 grid
+    std::vector<int> cellCount(16, 0);
+    for (int i = 0; i < 16; ++i)
+    {
+        V3f p = P[inds[i]];
+        int cx = int(p.x*4/(N-1));
+        int cy = int(p.y*4/(N-1));
+        cellCount[std::min(cx,3) + 4*std::min(cy,3)] += 1;
+    }
+    for (int i = 0; i < 16; ++i)
+        CHECK(cellCount[i] == 1);
+}
+
+
+TEST_CASE("parallelFor visits each index once")
+{
+    std::vector<std::atomic<int>> counts(1000);
+    for (auto& c : counts)
+        c = 0;
+    parallelFor(0, counts.size(), [&](size_t i) { counts[i] += 1; });
+    for (auto& c : counts)
+        CHECK(c == 1);
+}
+
+
+TEST_CASE("ThreadPool runs tasks and nested parallelFor")
+{
+    ThreadPool pool(4);
+    std::vector<std::atomic<int>> counts(100*100);
+    for (auto& c : counts)
+        c = 0;
+    // Nested calls must not wait on workers which are busy with outer calls
+    pool.parallelFor(0, 100, [&](size_t i)
+    {
+        pool.parallelFor(0, 100, [&](size_t j) { counts[i*100 + j] += 1; });
+    });
+    for (auto& c : counts)
+        CHECK(c == 1);
+    std::atomic<int> numRun(0);
+    for (int i = 0; i < 50; ++i)
+        pool.run([&]() { ++numRun; });
+    pool.wait();
+    CHECK(numRun == 50);
+}
+
+
+TEST_CASE("atomicMin keeps the smallest value")
+{
+    std::atomic<double> minValue(DBL_MAX);
+    parallelFor(0, 1000, [&](size_t i) { atomicMin(minValue, double((i*7919) % 1000)); });
+    CHECK(minValue.load() == 0);
+    atomicMin(minValue, 1.0);
+    CHECK(minValue.load() == 0);
+}